@@ -0,0 +1,551 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include <meter.h>
+
+// time each stage for at least this long, and at least BENCH_MIN_ITERS times
+#define BENCH_MIN_NSEC   500000000LL
+#define BENCH_MIN_ITERS  200
+#define BENCH_MAX_ITERS  200000
+
+// recorded frames kept in memory for the recorded runs
+#define BENCH_MAX_FRAMES 256
+
+typedef void (*BenchFunc)(void *arg, unsigned int iter);
+
+static long long samples[BENCH_MAX_ITERS];
+static Meter *meter = NULL;
+static MotionGate gate;
+static unsigned long published = 0;
+
+// results go here, stdout itself is silenced while updateValues runs
+static FILE *report = NULL;
+
+// meterRollup reports through this, count the calls instead of publishing
+void publishValues(Meter *m, time_t time, double last_minute, double last_10minute, double last_drain,
+                   double total) {
+   published++;
+}
+
+static long long nowNsec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmpSample(const void *a, const void *b) {
+   long long x = *(const long long *)a;
+   long long y = *(const long long *)b;
+   return (x > y) - (x < y);
+}
+
+// run one stage and print ns/frame, frames/s and percentiles
+static void bench(const char *name, BenchFunc func, void *arg) {
+   unsigned int n = 0;
+   long long total = 0;
+   long long start = nowNsec();
+
+   // warm up caches and the image pool
+   func(arg, 0);
+
+   while (n < BENCH_MAX_ITERS && (n < BENCH_MIN_ITERS || nowNsec() - start < BENCH_MIN_NSEC)) {
+      long long t0 = nowNsec();
+      func(arg, n);
+      samples[n] = nowNsec() - t0;
+      total += samples[n];
+      n++;
+   }
+   qsort(samples, n, sizeof(samples[0]), cmpSample);
+
+   double mean = (double)total / n;
+   fprintf(report, "%-24s %7u %10.0f %10lld %10lld %10lld %10lld %10.0f\n", name, n, mean,
+           samples[n / 2], samples[n * 90 / 100], samples[n * 99 / 100], samples[n - 1],
+           mean > 0 ? 1e9 / mean : 0.0);
+   fflush(report);
+}
+
+
+/* Synthetic frames */
+
+// YUYV frame of light grey with the given regions painted black
+static unsigned char *makeFrame(unsigned long long dark_mask, double fill) {
+   unsigned char *yuyv = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 2);
+   unsigned int i, x, y, n;
+
+   for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+      yuyv[i * 2 + 0] = 200;
+      yuyv[i * 2 + 1] = 128;
+   }
+   for (i = 0; i < meter->num_regions; i++) {
+      if (!(dark_mask & (1ull << i))) continue;
+      n = 0;
+      for (y = meter->region[i].y; y < meter->region[i].y + meter->region[i].h; y++) {
+         for (x = meter->region[i].x; x < meter->region[i].x + meter->region[i].w; x++) {
+            if (n++ < fill * meter->region[i].w * meter->region[i].h) yuyv[(y * IMAGE_WIDTH + x) * 2] = 20;
+         }
+      }
+   }
+   return yuyv;
+}
+
+// the same picture as the raw samples of a Bayer sensor
+static unsigned char *makeBayer(const unsigned char *yuyv) {
+   unsigned char *bayer = malloc(IMAGE_WIDTH * IMAGE_HEIGHT);
+   unsigned int i;
+
+   for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) bayer[i] = yuyv[i * 2];
+   return bayer;
+}
+
+static void bayerFrom(Frame *frame, const unsigned char *data, unsigned int pixelformat) {
+   memset(frame, 0, sizeof(*frame));
+   frame->width = IMAGE_WIDTH;
+   frame->height = IMAGE_HEIGHT;
+   frame->stride = IMAGE_WIDTH;
+   frame->pixelformat = pixelformat;
+   frame->bytesused = IMAGE_WIDTH * IMAGE_HEIGHT;
+   frame->data = data;
+}
+
+static void frameFrom(Frame *frame, const unsigned char *data) {
+   memset(frame, 0, sizeof(*frame));
+   frame->width = IMAGE_WIDTH;
+   frame->height = IMAGE_HEIGHT;
+   frame->stride = IMAGE_WIDTH * 2;
+   frame->bytesused = IMAGE_WIDTH * IMAGE_HEIGHT * 2;
+   frame->data = data;
+}
+
+
+/* Stages */
+
+typedef struct {
+   Frame *frames;
+   unsigned int n_frames;
+   Image *img;
+   Image *luma;
+   Viewer *view;
+} BenchCtx;
+
+static void stageConvertRef(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   Frame *frame = &ctx->frames[iter % ctx->n_frames];
+   yuyvToRgbRef(frame->data, (unsigned char *)ctx->img->data, IMAGE_WIDTH * IMAGE_HEIGHT);
+}
+
+static void stageBayerRef(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   Frame *frame = &ctx->frames[iter % ctx->n_frames];
+   bayerToRgbRef(frame->data, frame->stride, (unsigned char *)ctx->img->data, IMAGE_WIDTH, IMAGE_HEIGHT, 0, 1);
+}
+
+static void stageConvert(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   frmToImage(&ctx->frames[iter % ctx->n_frames], ctx->img);
+}
+
+static void stageConvertRegions(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   unsigned int n;
+   const Rect *rects = regionDecodeRects(meter, &n);
+   frmToImageRects(&ctx->frames[iter % ctx->n_frames], ctx->img, rects, n);
+}
+
+static void stageRecDetect(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   stageConvertRegions(arg, iter);
+   regionHit(meter, ctx->img);
+}
+
+// what the analysis does: the luma of the regions only
+static void stageLumaRegions(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   unsigned int n;
+   const Rect *rects = regionDecodeRects(meter, &n);
+   frmToImageRects(&ctx->frames[iter % ctx->n_frames], ctx->luma, rects, n);
+}
+
+static void stageRecDetectLuma(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   stageLumaRegions(arg, iter);
+   regionHit(meter, ctx->luma);
+}
+
+static void stageImgNew(void *arg, unsigned int iter) {
+   imgDestroy(imgNew(IMAGE_WIDTH, IMAGE_HEIGHT));
+}
+
+static void stageRegionHit(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   RegionScores scores;
+   regionScores(meter, ctx->img, &scores);
+}
+
+static void stageRegionHitLuma(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   RegionScores scores;
+   regionScores(meter, ctx->luma, &scores);
+}
+
+// the per-pixel loop regionHit used before the dark pixel table
+static void stageRegionLoop(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   unsigned int i;
+
+   for (i = 0; i < meter->num_regions; i++) {
+      if (regionCountLoop(meter, ctx->img, i) > (meter->region[i].w * meter->region[i].h) * 0.8) break;
+   }
+}
+
+// every region count has to match the reference loop, in colour and luma
+static void check(BenchCtx *ctx, const char *what) {
+   int mismatches = regionCheck(meter, ctx->img) + regionCheck(meter, ctx->luma);
+   if (mismatches) {
+      fprintf(report, "region counts differ from the reference loop on %s: %d regions\n", what, mismatches);
+      exit(1);
+   }
+}
+
+// the YUYV kernel in use has to match the reference on every possible pixel
+// pair (y0, cb, y1, cr), and on every run of up to 64 pixels, whatever tail
+// is left after the kernel's blocks, without writing past the end. A pixel
+// only depends on its own luma and the pair's chroma, so the reference is
+// run once per chroma for every luma and the kernel's output is compared
+// with that, a row of pairs with the same y0 at a time. The 2^32 pairs take
+// seconds, minutes unoptimised, -quick leaves them out.
+static void checkYuyv(int every_pair) {
+   unsigned int pairs = 65536;
+   uint32_t *luma = malloc(pairs * 4);
+   uint32_t *yuyv = malloc(pairs * 4);
+   unsigned char *out = malloc(pairs * 6);
+   unsigned char ref[256 * 3], row[256 * 6];
+   unsigned int c, i, y0, n;
+
+   // luma bytes of every pair, y0 = i >> 8 and y1 = i & 0xff, stored
+   // little endian as YUYV comes off the camera
+   for (i = 0; i < pairs; i++) luma[i] = (i >> 8) | (i & 0xff) << 16;
+
+   for (c = 0; every_pair && c < 65536; c++) {
+      uint32_t chroma = (c >> 8) << 8 | (c & 0xff) << 24;
+
+      for (i = 0; i < 128; i++) yuyv[i] = luma[i * 2 << 8 | (i * 2 + 1)] | chroma;
+      yuyvToRgbRef((const unsigned char *)yuyv, ref, 256);
+      for (i = 0; i < 256; i++) memcpy(row + i * 6 + 3, ref + i * 3, 3);
+
+      for (i = 0; i < pairs; i++) yuyv[i] = luma[i] | chroma;
+      yuyvToRgb((const unsigned char *)yuyv, out, pairs * 2);
+      for (y0 = 0; y0 < 256; y0++) {
+         for (i = 0; i < 256; i++) memcpy(row + i * 6, ref + y0 * 3, 3);
+         if (memcmp(out + y0 * 256 * 6, row, sizeof(row)) != 0) {
+            fprintf(report, "yuyv kernel %s differs from the reference, y0 %u cb %u cr %u\n", yuyvKernelName(),
+                    y0, c >> 8, c & 0xff);
+            exit(1);
+         }
+      }
+   }
+
+   srand(1);
+   for (i = 0; i < 64 * 2; i++) ((unsigned char *)yuyv)[i] = rand();
+   for (n = 0; n <= 64; n += 2) {
+      memset(out, 0xa5, 64 * 3 + 16);
+      yuyvToRgbRef((const unsigned char *)yuyv, ref, n);
+      yuyvToRgb((const unsigned char *)yuyv, out, n);
+      for (i = n * 3; i < 64 * 3 + 16 && out[i] == 0xa5; i++);
+      if (memcmp(out, ref, n * 3) != 0 || i < 64 * 3 + 16) {
+         fprintf(report, "yuyv kernel %s differs from the reference on %u pixels\n", yuyvKernelName(), n);
+         exit(1);
+      }
+   }
+   free(out);
+   free(yuyv);
+   free(luma);
+}
+
+// the Bayer conversion of every layout, of the whole frame and of the
+// regions, has to match the reference on noise, which exercises every path.
+// Its luma is the reference's green.
+static void checkBayer(void) {
+   static const unsigned int formats[4] = {
+      V4L2_PIX_FMT_SRGGB8, V4L2_PIX_FMT_SGRBG8, V4L2_PIX_FMT_SGBRG8, V4L2_PIX_FMT_SBGGR8
+   };
+   unsigned int size = IMAGE_WIDTH * IMAGE_HEIGHT * 3;
+   unsigned char *noise = malloc(IMAGE_WIDTH * IMAGE_HEIGHT);
+   unsigned char *ref = malloc(size);
+   Image *img = imgNew(IMAGE_WIDTH, IMAGE_HEIGHT);
+   Image *luma = imgNewFormat(IMAGE_WIDTH, IMAGE_HEIGHT, IMG_LUMA);
+   Rect edges[4] = {
+      { 0, 0, 5, IMAGE_HEIGHT }, { IMAGE_WIDTH - 4, 0, 4, IMAGE_HEIGHT },
+      { 1, 0, IMAGE_WIDTH - 2, 1 }, { 2, IMAGE_HEIGHT - 2, IMAGE_WIDTH - 3, 2 }
+   };
+   unsigned int f, i, n_rects;
+   const Rect *rects = regionDecodeRects(meter, &n_rects);
+   Frame frame;
+
+   srand(1);
+   for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) noise[i] = rand();
+
+   for (f = 0; f < 4; f++) {
+      bayerFrom(&frame, noise, formats[f]);
+      bayerToRgbRef(noise, IMAGE_WIDTH, ref, IMAGE_WIDTH, IMAGE_HEIGHT, f & 1, f >> 1);
+
+      frmToImage(&frame, img);
+      if (memcmp(img->data, ref, size) != 0) {
+         fprintf(report, "bayer conversion differs from the reference, layout %u\n", f);
+         exit(1);
+      }
+
+      // the rectangles only, the rest of the image left as the reference has it
+      memset(img->data, 0, size);
+      frmToImageRects(&frame, img, rects, n_rects);
+      frmToImageRects(&frame, img, edges, 4);
+      for (i = 0; i < size; i++) {
+         if (img->data[i] != 0 && (unsigned char)img->data[i] != ref[i]) {
+            fprintf(report, "bayer conversion of regions differs from the reference, layout %u\n", f);
+            exit(1);
+         }
+      }
+
+      frmToImage(&frame, luma);
+      for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+         if ((unsigned char)luma->data[i] != ref[i * 3 + 1]) {
+            fprintf(report, "bayer luma differs from the reference, layout %u\n", f);
+            exit(1);
+         }
+      }
+      memset(luma->data, 0, IMAGE_WIDTH * IMAGE_HEIGHT);
+      frmToImageRects(&frame, luma, rects, n_rects);
+      frmToImageRects(&frame, luma, edges, 4);
+      for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+         if (luma->data[i] != 0 && (unsigned char)luma->data[i] != ref[i * 3 + 1]) {
+            fprintf(report, "bayer luma of regions differs from the reference, layout %u\n", f);
+            exit(1);
+         }
+      }
+   }
+   imgDestroy(luma);
+   imgDestroy(img);
+   free(ref);
+   free(noise);
+}
+
+static void stageNeedleAngle(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   needleAngle(meter, ctx->img);
+}
+
+static void stageDisplay(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   unsigned int i;
+
+   for (i = 0; i < meter->num_regions; i++) {
+      drawRegion(ctx->img, meter->region[i], 0, 255, 0);
+   }
+   viewDisplayImage(ctx->view, ctx->img);
+}
+
+// scores with a single full hit on the given region
+static void scoresFor(RegionScores *scores, unsigned int hit) {
+   memset(scores, 0, sizeof(*scores));
+   scores->dark[hit] = 1.0f;
+   scores->hits = 1ull << hit;
+   scores->best = hit;
+}
+
+static void stageGate(void *arg, unsigned int iter) {
+   BenchCtx *ctx = arg;
+   gatePass(&gate, &ctx->frames[iter % ctx->n_frames], iter / 30.0);
+}
+
+static void stageUpdateIdle(void *arg, unsigned int iter) {
+   RegionScores scores;
+   scoresFor(&scores, 3);
+   updateValues(meter, &scores, -1.0, iter, iter / 30.0);
+}
+
+static void stageUpdateHit(void *arg, unsigned int iter) {
+   RegionScores scores;
+   scoresFor(&scores, iter % meter->num_regions);
+   updateValues(meter, &scores, -1.0, iter, iter / 30.0);
+}
+
+
+// convert a synthetic frame into the context images
+static void prepare(BenchCtx *ctx, unsigned char *yuyv) {
+   Frame frame;
+   frameFrom(&frame, yuyv);
+   frmToImage(&frame, ctx->img);
+   frmToImage(&frame, ctx->luma);
+}
+
+// load up to BENCH_MAX_FRAMES frames from a recording
+static unsigned int loadRecording(const char *filename, Frame *frames) {
+   Camera *rec = camOpenReplay(filename, IMAGE_WIDTH, IMAGE_HEIGHT, 0);
+   unsigned int n = 0;
+   Frame frame;
+
+   if (!rec) return 0;
+   while (n < BENCH_MAX_FRAMES && camBorrowFrame(rec, &frame) == 0) {
+      if (frame.width == IMAGE_WIDTH && frame.height == IMAGE_HEIGHT) {
+         unsigned char *copy = malloc(frame.bytesused);
+         memcpy(copy, frame.data, frame.bytesused);
+         frames[n] = frame;
+         frames[n].data = copy;
+         n++;
+      }
+      camReleaseFrame(rec, &frame);
+   }
+   camClose(rec);
+   return n;
+}
+
+int main(int argc, char * argv[])
+{
+   int    i;
+   char   *replay_file = NULL;
+   int    display = 1;
+   int    quick = 0;
+   unsigned int regions = NUM_REGIONS;
+   Frame  synthetic[1];
+   Frame  recorded[BENCH_MAX_FRAMES];
+   BenchCtx ctx;
+   int    devnull;
+
+   for (i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+         replay_file = argv[++i];
+      }
+      if (strcmp(argv[i], "-regions") == 0 && i + 1 < argc) {
+         regions = atoi(argv[++i]);
+      }
+      if (strcmp(argv[i], "-nodisplay") == 0) {
+         display = 0;
+      }
+      if (strcmp(argv[i], "-quick") == 0) {
+         quick = 1;
+      }
+   }
+
+   meter = meterNew("", ORG_X, ORG_Y, ORG_R, regions);
+   {
+      unsigned int n_rects;
+      const Rect *rects = regionDecodeRects(meter, &n_rects);
+      gateInit(&gate, rects, n_rects);
+   }
+
+   // the viewer stage runs headless unless there is a display
+   if (!getenv("DISPLAY")) setenv("SDL_VIDEODRIVER", "dummy", 0);
+   init_imgproc();
+
+   ctx.img = imgNew(IMAGE_WIDTH, IMAGE_HEIGHT);
+   ctx.luma = imgNewFormat(IMAGE_WIDTH, IMAGE_HEIGHT, IMG_LUMA);
+   ctx.view = display ? viewOpen(IMAGE_WIDTH, IMAGE_HEIGHT, "WATER-METER-BENCH") : NULL;
+
+   unsigned char *blank = makeFrame(0, 0.0);
+   unsigned char *hit = makeFrame(1u << 0, 1.0);
+   unsigned char *worst = makeFrame(~0ull >> (65 - meter->num_regions), 0.75);
+
+   // the last region is fully dark, every other one just misses the threshold
+   {
+      unsigned char *last = makeFrame(1ull << (meter->num_regions - 1), 1.0);
+      for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT * 2; i += 2) {
+         if (last[i] < worst[i]) worst[i] = last[i];
+      }
+      free(last);
+   }
+
+   frameFrom(&synthetic[0], hit);
+
+   report = fdopen(dup(STDOUT_FILENO), "w");
+   fprintf(report, "yuyv kernel: %s, regions: %u\n", yuyvKernelName(), meter->num_regions);
+   fprintf(report, "%-24s %7s %10s %10s %10s %10s %10s %10s\n", "stage", "iters", "ns/frame",
+           "p50", "p90", "p99", "max", "frames/s");
+
+   ctx.frames = synthetic;
+   ctx.n_frames = 1;
+   checkYuyv(!quick);
+   bench("convert-ref", stageConvertRef, &ctx);
+   bench("convert", stageConvert, &ctx);
+   bench("convert-regions", stageConvertRegions, &ctx);
+   bench("luma-regions", stageLumaRegions, &ctx);
+   bench("img-new-destroy", stageImgNew, &ctx);
+   bench("motion-gate", stageGate, &ctx);
+
+   prepare(&ctx, hit);
+   check(&ctx, "hit");
+   bench("region-hit", stageRegionHit, &ctx);
+   prepare(&ctx, blank);
+   check(&ctx, "miss");
+   bench("region-miss", stageRegionHit, &ctx);
+   prepare(&ctx, worst);
+   check(&ctx, "worst");
+   bench("region-worst", stageRegionHit, &ctx);
+   bench("region-worst-loop", stageRegionLoop, &ctx);
+   bench("region-worst-luma", stageRegionHitLuma, &ctx);
+   bench("needle-angle", stageNeedleAngle, &ctx);
+
+   if (ctx.view) {
+      prepare(&ctx, hit);
+      bench("draw-display", stageDisplay, &ctx);
+   }
+
+   // raw sensor boards
+   checkBayer();
+   unsigned char *bayer = makeBayer(hit);
+   bayerFrom(&synthetic[0], bayer, V4L2_PIX_FMT_SGBRG8);
+   frmToImage(&synthetic[0], ctx.img);
+   frmToImage(&synthetic[0], ctx.luma);
+   check(&ctx, "bayer hit");
+   bench("bayer-ref", stageBayerRef, &ctx);
+   bench("bayer", stageConvert, &ctx);
+   bench("bayer-regions", stageConvertRegions, &ctx);
+   bench("bayer-luma-regions", stageLumaRegions, &ctx);
+   bench("bayer-motion-gate", stageGate, &ctx);
+   frameFrom(&synthetic[0], hit);
+   free(bayer);
+
+   // updateValues logs every hit, keep that out of the report
+   fflush(stdout);
+   devnull = open("/dev/null", O_WRONLY);
+   dup2(devnull, STDOUT_FILENO);
+   bench("update-idle", stageUpdateIdle, &ctx);
+   bench("update-hit", stageUpdateHit, &ctx);
+   fflush(stdout);
+   close(devnull);
+
+   if (replay_file) {
+      ctx.frames = recorded;
+      ctx.n_frames = loadRecording(replay_file, recorded);
+      if (ctx.n_frames == 0) {
+         fprintf(stderr, "No usable frames in %s\n", replay_file);
+         return 1;
+      }
+      fprintf(report, "recorded frames: %u\n", ctx.n_frames);
+      for (i = 0; i < ctx.n_frames; i++) {
+         frmToImage(&ctx.frames[i], ctx.img);
+         frmToImage(&ctx.frames[i], ctx.luma);
+         check(&ctx, "recorded frame");
+      }
+      bench("rec-convert", stageConvert, &ctx);
+      bench("rec-convert-regions", stageConvertRegions, &ctx);
+      bench("rec-detect", stageRecDetect, &ctx);
+      bench("rec-detect-luma", stageRecDetectLuma, &ctx);
+      bench("rec-motion-gate", stageGate, &ctx);
+   }
+
+   free(blank);
+   free(hit);
+   free(worst);
+   imgDestroy(ctx.img);
+   imgDestroy(ctx.luma);
+   gateFree(&gate);
+   meterFree(meter);
+   if (ctx.view) viewClose(ctx.view);
+   quit_imgproc();
+   fclose(report);
+   return 0;
+}
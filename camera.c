@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <assert.h>
 
 #include <getopt.h>             /* getopt_long() */
@@ -15,27 +16,93 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <limits.h>
 
 #include <asm/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
+#include <linux/usbdevice_fs.h>
 
 //#include <Python.h>
 
 #include "imgproc.h"
 
 
+// seconds without a frame before a camera is given up on and reset
+#define CAM_TIMEOUT	20
+
+// recovery: seconds for a camera to come back after a USB reset before it is
+// reopened, and the longest wait between failed attempts, which double
+#define CAM_SETTLE	2
+#define CAM_BACKOFF_MAX	64
+
+
+// formats taken, in order of preference. Detection only needs the luma, which
+// a grey camera gives as it is and YUYV has every other byte of. Cameras
+// with neither are raw sensor boards that only give the Bayer mosaic. MJPEG
+// has to be decoded, it comes last unless asked for, as for sizes a camera
+// can only send at full rate compressed.
+static const unsigned int cam_formats[] = {
+	V4L2_PIX_FMT_GREY,
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_SGBRG8,
+	V4L2_PIX_FMT_SGRBG8,
+	V4L2_PIX_FMT_SBGGR8,
+	V4L2_PIX_FMT_SRGGB8,
+	V4L2_PIX_FMT_MJPEG
+};
+
+
+// MJPEG luma blocks are filled with their average rather than transformed
+static int cam_jpeg_dc_only = 0;
+
+
 struct Buffer {
 	struct v4l2_buffer buf;
 	void * start;
 };
 
 
-static void errno_exit(const char *s)
+// where a V4L2 camera is. Any error while streaming closes the device and
+// starts a recovery: reset the camera's USB device, give it time to come
+// back, reopen it and start streaming again, with a longer wait after every
+// attempt that fails.
+typedef enum {
+	V4L2_STREAMING,
+	V4L2_RESET,	// waiting to reset the USB device
+	V4L2_REOPEN	// waiting to open the device again
+} V4l2State;
+
+
+// state of a V4L2 camera. The camera's wait fd is an epoll set of the
+// device and the recovery timer, so it stays the same while the device is
+// closed and opened again.
+typedef struct {
+	V4l2State state;
+	int timer_fd;
+	unsigned int width;	// as asked for, to open the device again
+	unsigned int height;
+	unsigned int prefer;
+	unsigned int got_width;	// as negotiated when first opened, 0 before
+	unsigned int got_height;
+	unsigned int got_stride;
+	unsigned int got_format;
+	unsigned int fps;	// rate last asked for, 0 for the driver's
+	unsigned int attempts;
+	unsigned int backoff;
+	char usb[PATH_MAX];	// sysfs directory of the USB device, or empty
+} V4l2;
+
+
+// report a failed call, the device is given up on
+static int errno_report(Camera * cam, const char *s)
 {
-        fprintf (stderr, "%s error %d, %s\n",
-			s, errno, strerror (errno));
+        fprintf (stderr, "%s: %s error %d, %s\n",
+			cam->name, s, errno, strerror (errno));
 
-        exit (EXIT_FAILURE);
+        return -1;
 }
 
 
@@ -50,8 +117,9 @@ static int xioctl(Camera * cam, int request, void *arg)
 }
 
 
-// routine to initialise memory mapped i/o on the camera device
-static void init_mmap(Camera * cam)
+// routine to initialise memory mapped i/o on the camera device. On failure
+// the buffers mapped so far are left for v4l2Stop.
+static int init_mmap(Camera * cam)
 {
 	struct v4l2_requestbuffers req;
 
@@ -65,16 +133,16 @@ static void init_mmap(Camera * cam)
 		if (EINVAL == errno) {
 			fprintf (stderr, "%s does not support "
 					"memory mapping\n", cam->name);
-			exit (EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit ("VIDIOC_REQBUFS");
+			return errno_report (cam, "VIDIOC_REQBUFS");
 		}
 	}
 
 	if (req.count < 2) {
 		fprintf (stderr, "Insufficient buffer memory on %s\n",
 				 cam->name);
-		exit (EXIT_FAILURE);
+		return -1;
 	}
 
 	// allocate memory for the buffers
@@ -82,7 +150,7 @@ static void init_mmap(Camera * cam)
 
 	if (!cam->buffers) {
 		fprintf (stderr, "Out of memory\n");
-		exit (EXIT_FAILURE);
+		return -1;
 	}
 
 	for (cam->n_buffers = 0; cam->n_buffers < req.count; cam->n_buffers++) {
@@ -95,7 +163,7 @@ static void init_mmap(Camera * cam)
 		buffer.index       = cam->n_buffers;
 
 		if (-1 == xioctl (cam, VIDIOC_QUERYBUF, &buffer)){
-			errno_exit ("VIDIOC_QUERYBUF");
+			return errno_report (cam, "VIDIOC_QUERYBUF");
 		}
 
 		// copy the v4l2 buffer into the device buffers
@@ -111,136 +179,481 @@ static void init_mmap(Camera * cam)
 			);
 
 		if (MAP_FAILED == cam->buffers[cam->n_buffers].start){
-			errno_exit ("mmap");
+			return errno_report (cam, "mmap");
 		}
 	}
+
+	return 0;
 }
 
 
-// returns an index to the dequeued buffer
-static unsigned int camDequeueBuffer(Camera * cam)
+// dequeues a filled buffer without waiting, returns 0 with the driver's buffer
+// details, 1 when no buffer is ready yet and -1 when the device failed
+static int camDequeueBuffer(Camera * cam, struct v4l2_buffer * buffer)
 {
-	while(1){
-		fd_set fds;
-		struct timeval tv;
-		int r;
+	memset (buffer, 0, sizeof (*buffer));
 
-		
-		FD_ZERO (&fds);
-		FD_SET (cam->handle, &fds);
+	buffer->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer->memory = V4L2_MEMORY_MMAP;
 
-		// Timeout.
-		tv.tv_sec = 20;
-		tv.tv_usec = 0;
+	// dequeue a buffer, the device is opened non-blocking
+	if (-1 == xioctl (cam, VIDIOC_DQBUF, buffer)) {
+		switch (errno) {
+			case EAGAIN:
+				return 1;
 
-		
-		r = select (cam->handle + 1, &fds, NULL, NULL, &tv);
+			case EIO:
+				/* Could ignore EIO, see spec. */
+				/* fall through */
 
-		if (-1 == r) {
-			if (EINTR == errno){
-				continue;
-			}
-			errno_exit ("select");
+			default:
+				return errno_report (cam, "VIDIOC_DQBUF");
+		}
+	}
+	assert (buffer->index < cam->n_buffers);
+
+	return 0;
+}
+
+
+// enqueue a given device buffer to the device, returns -1 when the device failed
+static int camEnqueueBuffer(Camera * cam, unsigned int buffer_id)
+{
+	// enqueue a given buffer by index
+	if(-1 == xioctl(cam, VIDIOC_QBUF, &(cam->buffers[buffer_id].buf) )){
+		return errno_report(cam, "VIDIOC_QBUF");
+	}
+
+	return 0;
+}
+	
+
+// convert one rectangle of a YUYV frame into the same place in the image
+static void yuyvToRgbRect(const Frame * frame, Image * img, const Rect * rect)
+{
+	// YUYV shares chroma between pixel pairs, so widen the rectangle to even columns
+	unsigned int x0 = rect->x & ~1u;
+	unsigned int x1 = rect->x + rect->w;
+	unsigned int y1 = rect->y + rect->h;
+
+	x1 = (x1 + 1) & ~1u;
+	if(x1 > img->width) x1 = img->width & ~1u;
+	if(y1 > img->height) y1 = img->height;
+	if(x0 >= x1) return;
+
+	for(unsigned int y = rect->y; y < y1; y++){
+		const unsigned char * src = frame->data + y * frame->stride + x0 * 2;
+		yuyvToRgb(src, (unsigned char *)img->data + (x0 + y * img->width) * 3, x1 - x0);
+	}
+}
+
+
+// Where red sits in the 2x2 tile of an 8 bit Bayer format, returns -1 for
+// anything else
+static int bayerRedSite(unsigned int pixelformat, unsigned int * red_x, unsigned int * red_y)
+{
+	switch(pixelformat){
+		case V4L2_PIX_FMT_SRGGB8: *red_x = 0; *red_y = 0; return 0;
+		case V4L2_PIX_FMT_SGRBG8: *red_x = 1; *red_y = 0; return 0;
+		case V4L2_PIX_FMT_SGBRG8: *red_x = 0; *red_y = 1; return 0;
+		case V4L2_PIX_FMT_SBGGR8: *red_x = 1; *red_y = 1; return 0;
+		default: return -1;
+	}
+}
+
+
+// Bytes from one pixel to the next along a row. The first byte of a pixel
+// is its luma in YUYV and grey frames and its one colour sample in a Bayer
+// frame. Compressed frames have no pixels to read in place, 0.
+unsigned int frmPixelStep(const Frame * frame)
+{
+	unsigned int red_x, red_y;
+
+	if(frame->pixelformat == V4L2_PIX_FMT_MJPEG){
+		return 0;
+	}
+	if(frame->pixelformat == V4L2_PIX_FMT_GREY || bayerRedSite(frame->pixelformat, &red_x, &red_y) == 0){
+		return 1;
+	}
+	return 2;
+}
+
+
+// Decode MJPEG luma at full detail or only the average of every 8x8 block,
+// which is enough when the needle is many blocks wide
+void frmJpegDcOnly(int dc_only)
+{
+	cam_jpeg_dc_only = dc_only;
+}
+
+
+// Decode the rectangles of an MJPEG frame in one pass over it. A colour image
+// gets the luma as grey, only the viewer asks for one.
+static int jpegToImage(const Frame * frame, Image * img, const Rect * rects, unsigned int n_rects)
+{
+	if(img->format == IMG_LUMA){
+		return jpegToLuma(frame->data, frame->bytesused, (unsigned char *)img->data,
+				  img->width, img->height, rects, n_rects, cam_jpeg_dc_only);
+	}
+
+	Image * luma = imgNewFormat(img->width, img->height, IMG_LUMA);
+	if(luma == NULL){
+		return -1;
+	}
+	int result = jpegToLuma(frame->data, frame->bytesused, (unsigned char *)luma->data,
+				img->width, img->height, rects, n_rects, cam_jpeg_dc_only);
+	for(unsigned int i = 0; i < n_rects && result == 0; i++){
+		unsigned int x1 = rects[i].x + rects[i].w;
+		unsigned int y1 = rects[i].y + rects[i].h;
+
+		if(x1 > img->width) x1 = img->width;
+		if(y1 > img->height) y1 = img->height;
+		for(unsigned int y = rects[i].y; y < y1 && rects[i].x < x1; y++){
+			greyToRgb((unsigned char *)luma->data + y * img->width + rects[i].x,
+				  (unsigned char *)img->data + (y * img->width + rects[i].x) * 3, x1 - rects[i].x);
 		}
+	}
+	imgDestroy(luma);
+	return result;
+}
+
 
-		if (0 == r) {
-			fprintf (stderr, "select timeout\n");
-			exit (EXIT_FAILURE);
+// convert one rectangle of a frame of any format into the same place in an
+// image of either format
+static void frmRectToImage(const Frame * frame, Image * img, const Rect * rect)
+{
+	unsigned char * data = (unsigned char *)img->data;
+	unsigned int x1 = rect->x + rect->w;
+	unsigned int y1 = rect->y + rect->h;
+	unsigned int red_x, red_y;
+
+	if(bayerRedSite(frame->pixelformat, &red_x, &red_y) == 0){
+		if(img->format == IMG_LUMA){
+			bayerToLuma(frame->data, frame->stride, data, img->width, img->height, red_x, red_y, rect);
+		} else {
+			bayerToRgb(frame->data, frame->stride, data, img->width, img->height, red_x, red_y, rect);
 		}
+		return;
+	}
+	if(frame->pixelformat != V4L2_PIX_FMT_GREY && img->format == IMG_RGB){
+		yuyvToRgbRect(frame, img, rect);
+		return;
+	}
 
-		
-		// read the frame
-		struct v4l2_buffer buffer;
-		memset (&(buffer), 0, sizeof (buffer));
+	if(x1 > img->width) x1 = img->width;
+	if(y1 > img->height) y1 = img->height;
+	if(rect->x >= x1) return;
+
+	for(unsigned int y = rect->y; y < y1; y++){
+		const unsigned char * src = frame->data + y * frame->stride;
+		unsigned char * dst = data + (rect->x + y * img->width) * img->bpp;
+
+		if(frame->pixelformat != V4L2_PIX_FMT_GREY){
+			yuyvToLuma(src + rect->x * 2, dst, x1 - rect->x);
+		} else if(img->format == IMG_LUMA){
+			memcpy(dst, src + rect->x, x1 - rect->x);
+		} else {
+			greyToRgb(src + rect->x, dst, x1 - rect->x);
+		}
+	}
+}
+
+
+unsigned int camGetWidth(Camera * cam)
+{
+	return cam->width;
+}
+
+
+unsigned int camGetHeight(Camera * cam)
+{
+	return cam->height;
+}
+
+
+static void v4l2Fail(Camera * cam);
+static void v4l2Step(Camera * cam);
+
+
+// V4L2 source: frames are borrowed straight out of the mmap'd device buffers.
+// A camera being recovered has none, it takes the next step instead when its
+// timer is due.
+static int v4l2Borrow(Camera * cam, Frame * frame)
+{
+	V4l2 * v4l2 = cam->priv;
+	struct v4l2_buffer buffer;
+
+	if(v4l2->state != V4L2_STREAMING){
+		v4l2Step(cam);
+		return 1;
+	}
+
+	// dequeue a buffer
+	int r = camDequeueBuffer(cam, &buffer);
+	if(r != 0){
+		if(r == -1){
+			v4l2Fail(cam);
+		}
+		return 1;
+	}
+	unsigned int buffer_id = buffer.index;
+
+	frame->width = cam->width;
+	frame->height = cam->height;
+	frame->stride = cam->stride;
+	frame->pixelformat = cam->pixelformat;
+	frame->sequence = buffer.sequence;
+	frame->timestamp = buffer.timestamp;
+	frame->bytesused = buffer.bytesused;
+	frame->data = cam->buffers[buffer_id].start;
+	frame->index = buffer_id;
+
+	return 0;
+}
+
+
+static void v4l2Release(Camera * cam, Frame * frame)
+{
+	V4l2 * v4l2 = cam->priv;
+
+	// requeue the buffer
+	if(v4l2->state == V4L2_STREAMING && camEnqueueBuffer(cam, frame->index) != 0){
+		v4l2Fail(cam);
+	}
+}
+
+
+// Ask the driver for fps frames a second. Drivers that refuse while streaming
+// have the stream restarted, so no frame may be borrowed. Returns the rate the
+// driver settled on, or -1 when it has no say in the rate. A camera being
+// recovered is asked again once it is back.
+static int v4l2SetRate(Camera * cam, unsigned int fps)
+{
+	V4l2 * v4l2 = cam->priv;
+	struct v4l2_streamparm parm;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int r;
 
-		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buffer.memory = V4L2_MEMORY_MMAP;
-		
-		// dequeue a buffer
-		if (-1 == xioctl (cam, VIDIOC_DQBUF, &buffer)) {
-			switch (errno) {
-				case EAGAIN:
-					continue;
-
-				case EIO:
-					/* Could ignore EIO, see spec. */
-					/* fall through */
-
-				default:
-					errno_exit ("VIDIOC_DQBUF");
+	v4l2->fps = fps;
+	if (v4l2->state != V4L2_STREAMING) {
+		return -1;
+	}
+
+	memset (&parm, 0, sizeof (parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (-1 == xioctl (cam, VIDIOC_G_PARM, &parm) ||
+	    !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+		return -1;
+	}
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = fps;
+
+	r = xioctl (cam, VIDIOC_S_PARM, &parm);
+	if (-1 == r && EBUSY == errno) {
+		// stopping the stream takes every buffer back from the driver
+		if (-1 == xioctl (cam, VIDIOC_STREAMOFF, &type)) {
+			errno_report (cam, "VIDIOC_STREAMOFF");
+			v4l2Fail (cam);
+			return -1;
+		}
+		r = xioctl (cam, VIDIOC_S_PARM, &parm);
+		for (unsigned int i = 0; i < cam->n_buffers; ++i) {
+			if (camEnqueueBuffer(cam, i) != 0) {
+				v4l2Fail (cam);
+				return -1;
 			}
 		}
-		assert (buffer.index < cam->n_buffers);
+		if (-1 == xioctl (cam, VIDIOC_STREAMON, &type)) {
+			errno_report (cam, "VIDIOC_STREAMON");
+			v4l2Fail (cam);
+			return -1;
+		}
+	}
+	if (-1 == r || 0 == parm.parm.capture.timeperframe.numerator) {
+		return -1;
+	}
+
+	return parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+}
+
+
+// The descriptor to wait on for camTryBorrowFrame, readable when a frame may
+// be ready
+int camGetFd(Camera * cam)
+{
+	return cam->wait_fd;
+}
+
+
+// Borrow the next captured frame from the camera's source, waiting for it.
+// The frame is read only and stays valid until it is handed back with
+// camReleaseFrame. A camera that stops sending is recovered while waiting.
+// Returns -1 when the source has no more frames.
+int camBorrowFrame(Camera * cam, Frame * frame)
+{
+	while(1){
+		int r = camTryBorrowFrame(cam, frame);
+		if(r != 1){
+			return r;
+		}
 
-		// return the buffer index handle to the buffer
-		return buffer.index;
+		struct pollfd pfd = { cam->wait_fd, POLLIN, 0 };
+		r = poll(&pfd, 1, CAM_TIMEOUT * 1000);
+		if(-1 == r && EINTR != errno){
+			errno_report (cam, "poll");
+			return -1;
+		}
+		if(0 == r){
+			camPollOverdue(cam);
+		}
 	}
 }
 
 
-// enqueue a given device buffer to the device
-static void camEnqueueBuffer(Camera * cam, unsigned int buffer_id)
+// Give up on the camera's stream and recover it as after an error, for
+// cameras that have gone quiet. Returns -1 for sources that cannot be
+// recovered.
+int camRecover(Camera * cam)
 {
-	// enqueue a given buffer by index
-	if(-1 == xioctl(cam, VIDIOC_QBUF, &(cam->buffers[buffer_id].buf) )){
-		errno_exit("VIDIOC_QBUF");
+	if(cam->source->recover == NULL){
+		return -1;
 	}
+	cam->source->recover(cam);
+	return 0;
+}
+
 
-	return;
+// Give up on a camera that has gone CAM_TIMEOUT seconds without a frame and
+// recover it, for callers that wait on camGetFd themselves and should call
+// this every so often. Returns 1 when the camera was given up on.
+int camPollOverdue(Camera * cam)
+{
+	struct timespec now;
+
+	if(cam->source->recover == NULL){
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(now.tv_sec - cam->last_frame.tv_sec < CAM_TIMEOUT){
+		return 0;
+	}
+	fprintf (stderr, "%s: no frame for %d s\n", cam->name, CAM_TIMEOUT);
+	camRecover(cam);
+	cam->last_frame = now;
+	return 1;
 }
-	
+
+
+// Borrow a frame if one is ready, without waiting. Returns 0 with a frame,
+// 1 when there is none yet and -1 when the source has no more frames.
+int camTryBorrowFrame(Camera * cam, Frame * frame)
+{
+	int r = cam->source->borrow(cam, frame);
+	if(r == 0){
+		clock_gettime(CLOCK_MONOTONIC, &cam->last_frame);
+	}
+	return r;
+}
+
+
+// Change the rate frames are captured at, no frame may be borrowed. Returns
+// the rate the source settled on, or -1 when it cannot be changed.
+int camSetFrameRate(Camera * cam, unsigned int fps)
+{
+	if(!cam->source->set_rate){
+		return -1;
+	}
+	return cam->source->set_rate(cam, fps);
+}
+
+
+// Hand a borrowed frame back to the source
+void camReleaseFrame(Camera * cam, Frame * frame)
+{
+	cam->source->release(cam, frame);
+	frame->data = NULL;
+}
+
+
+// Convert a whole frame into an image of the same size, in the image's
+// format. Returns -1 for a compressed frame that cannot be decoded.
+int frmToImage(const Frame * frame, Image * img)
+{
+	Rect all = { 0, 0, frame->width, frame->height };
+
+	if(frame->pixelformat == V4L2_PIX_FMT_MJPEG){
+		return jpegToImage(frame, img, &all, 1);
+	}
+	if(frmPixelStep(frame) == 2 && img->format == IMG_RGB && frame->stride == frame->width * 2){
+		yuyvToRgb(frame->data, (unsigned char *)img->data, img->width * img->height);
+	} else {
+		frmRectToImage(frame, img, &all);
+	}
+	return 0;
+}
+
+
+// Convert only the given rectangles of a frame, the remaining pixels of the
+// image are left untouched. Returns -1 for a compressed frame that cannot be
+// decoded, the rectangles are not to be used then.
+int frmToImageRects(const Frame * frame, Image * img, const Rect * rects, unsigned int n_rects)
+{
+	if(frame->pixelformat == V4L2_PIX_FMT_MJPEG){
+		return jpegToImage(frame, img, rects, n_rects);
+	}
+	for(unsigned int i = 0; i < n_rects; i++){
+		frmRectToImage(frame, img, &rects[i]);
+	}
+	return 0;
+}
+
 
 Image * camGrabImage(Camera * cam)
 {
+	Frame frame;
+
 	// Create a new image
 	Image * img = imgNew(cam->width, cam->height);
 
 
-	// dequeue a buffer
-	unsigned int buffer_id = camDequeueBuffer(cam);
-
-
 	// Copy data across, converting to RGB along the way
-	char * buffer_ptr = cam->buffers[buffer_id].start;
-	char * img_ptr = img->data;
-
-	// iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB
-	for(uint32_t i = 0, j = 0; i < (img->width * img->height * 2); i+=4, j+=6){
-		char * buffer_pos = buffer_ptr + i;
-		char * img_pos = img_ptr + j;
-		
-
-		// YCbCr to RGB conversion (from: http://www.equasys.de/colorconversion.html);
-		int y0 = buffer_pos[0];
-		int cb = buffer_pos[1];
-		int y1 = buffer_pos[2];
-		int cr = buffer_pos[3];
-		int r;
-		int g;
-		int b;
-
-		// first RGB
-		r = y0 + ((357 * cr) >> 8) - 179;
-
-		g = y0 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-		b = y0 + ((450 * cb) >> 8) - 226;
-		// clamp to 0 to 255
-		img_pos[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
-		img_pos[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
-		img_pos[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
-		
-		// second RGB
-		r = y1 + ((357 * cr) >> 8) - 179;
-		g = y1 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-		b = y1 + ((450 * cb) >> 8) - 226;
-		img_pos[5] = r > 254 ? 255 : (r < 0 ? 0 : r);
-		img_pos[4] = g > 254 ? 255 : (g < 0 ? 0 : g);
-		img_pos[3] = b > 254 ? 255 : (b < 0 ? 0 : b);
+	if(camBorrowFrame(cam, &frame) != 0){
+		imgDestroy(img);
+		return NULL;
+	}
+	if(frmToImage(&frame, img) != 0){
+		imgDestroy(img);
+		img = NULL;
 	}
+	camReleaseFrame(cam, &frame);
 
 
-	// requeue the buffer
-	camEnqueueBuffer(cam, buffer_id);
+	// return the image
+	return img;
+}
+
+
+// Grab an image where only the given rectangles are converted, the remaining
+// pixels are left undefined. Use when the whole frame is never looked at.
+Image * camGrabImageRects(Camera * cam, const Rect * rects, unsigned int n_rects)
+{
+	Frame frame;
+
+	// Create a new image
+	Image * img = imgNew(cam->width, cam->height);
+
+
+	// Convert the regions of interest only
+	if(camBorrowFrame(cam, &frame) != 0){
+		imgDestroy(img);
+		return NULL;
+	}
+	if(frmToImageRects(&frame, img, rects, n_rects) != 0){
+		imgDestroy(img);
+		img = NULL;
+	}
+	camReleaseFrame(cam, &frame);
 
 
 	// return the image
@@ -248,45 +661,99 @@ Image * camGrabImage(Camera * cam)
 }
 
 
-static void camSetFormat(Camera * cam, unsigned int width, unsigned int height)
+// Negotiate the format, map the buffers and start streaming. Returns -1 when
+// the device cannot be used, whatever was set up is left for v4l2Stop.
+static int camSetFormat(Camera * cam, unsigned int width, unsigned int height, unsigned int prefer)
 {
 	//printf("Setting device format\n");
 
 	struct v4l2_format fmt;
+	struct v4l2_fmtdesc desc;
 	unsigned int min;
+	unsigned int i;
+	unsigned int n_formats = sizeof (cam_formats) / sizeof (cam_formats[0]);
+	unsigned int order[sizeof (cam_formats) / sizeof (cam_formats[0]) + 1];
+	int offered[sizeof (cam_formats) / sizeof (cam_formats[0]) + 1] = { 0 };
+
+	// a format asked for goes before the usual order
+	order[0] = prefer;
+	memcpy (order + 1, cam_formats, sizeof (cam_formats));
+
+	// what the driver offers, a driver that cannot say is asked for each
+	memset (&(desc), 0, sizeof (desc));
+	desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	while (0 == xioctl (cam, VIDIOC_ENUM_FMT, &desc)) {
+		for (i = 0; i <= n_formats; i++) {
+			if (desc.pixelformat == order[i]) offered[i] = 1;
+		}
+		desc.index++;
+	}
 
-	memset (&(fmt), 0, sizeof (fmt));
-	
-	fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width       = width; 
-	fmt.fmt.pix.height      = height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-	fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+	// take the first format offered that the driver does not swap for one
+	// of its own
+	for (i = prefer ? 0 : 1; i <= n_formats; i++) {
+		if (desc.index > 0 && !offered[i]) {
+			continue;
+		}
+		memset (&(fmt), 0, sizeof (fmt));
 
-	if (-1 == xioctl (cam, VIDIOC_S_FMT, &fmt)){
-		errno_exit ("VIDIOC_S_FMT");
+		fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width       = width; 
+		fmt.fmt.pix.height      = height;
+		fmt.fmt.pix.pixelformat = order[i];
+		fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+
+		if (-1 == xioctl (cam, VIDIOC_S_FMT, &fmt)){
+			return errno_report (cam, "VIDIOC_S_FMT");
+		}
+		if (fmt.fmt.pix.pixelformat == order[i]) {
+			break;
+		}
+	}
+	if (i > n_formats) {
+		fprintf (stderr, "%s offers neither grey, YUYV, 8 bit Bayer nor MJPEG\n", cam->name);
+		return -1;
+	}
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+		fprintf (stderr, "%s: capturing %.4s\n", cam->name, (const char *)&fmt.fmt.pix.pixelformat);
+	}
+	if (fmt.fmt.pix.width != width || fmt.fmt.pix.height != height) {
+		fprintf (stderr, "%s: %ux%u instead of %ux%u\n", cam->name,
+			 fmt.fmt.pix.width, fmt.fmt.pix.height, width, height);
 	}
 
     // Note VIDIOC_S_FMT may change width and height.
 	
-	// Buggy driver paranoia.
-	min = fmt.fmt.pix.width * 2;
-	if (fmt.fmt.pix.bytesperline < min)
-		fmt.fmt.pix.bytesperline = min;
-	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-	if (fmt.fmt.pix.sizeimage < min)
-		fmt.fmt.pix.sizeimage = min;
+	// Buggy driver paranoia. Compressed frames have no lines.
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
+		min = fmt.fmt.pix.width * (fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1);
+		if (fmt.fmt.pix.bytesperline < min)
+			fmt.fmt.pix.bytesperline = min;
+		min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+		if (fmt.fmt.pix.sizeimage < min)
+			fmt.fmt.pix.sizeimage = min;
+	}
 
 	// ONLY CHANGES IN IMAGE SIZE ARE HANDLED ATM
 	// set device image size to the returned width and height.
 	cam->width = fmt.fmt.pix.width;
 	cam->height = fmt.fmt.pix.height;
+	cam->stride = fmt.fmt.pix.bytesperline;
+	cam->pixelformat = fmt.fmt.pix.pixelformat;
+
+	// compressed frames have no lines, their buffer size is spread over the
+	// rows so that stride * height still bounds a frame for recordings
+	if (cam->pixelformat == V4L2_PIX_FMT_MJPEG) {
+		cam->stride = (fmt.fmt.pix.sizeimage + cam->height - 1) / cam->height;
+	}
 	
 
 	//printf("Initialising memory mapped i/o\n");
 	
 	// initialise for memory mapped io
-	init_mmap (cam);
+	if (init_mmap (cam) != 0) {
+		return -1;
+	}
 	
 	
 	// initialise streaming for capture
@@ -295,7 +762,9 @@ static void camSetFormat(Camera * cam, unsigned int width, unsigned int height)
 	// queue buffers ready for capture
 	for (unsigned int i = 0; i < cam->n_buffers; ++i) {
 		// buffers are initialised, so just call the enqueue function
-		camEnqueueBuffer(cam, i);		
+		if (camEnqueueBuffer(cam, i) != 0) {
+			return -1;
+		}
 	}
 	
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -304,92 +773,86 @@ static void camSetFormat(Camera * cam, unsigned int width, unsigned int height)
 	if (-1 == xioctl (cam, VIDIOC_STREAMON, &type)){
 		if(errno == EINVAL){
 			fprintf(stderr, "buffer type not supported, or no buffers allocated or mapped\n");
-			exit(EXIT_FAILURE);
+			return -1;
 		} else if(errno == EPIPE){
 			fprintf(stderr, "The driver implements pad-level format configuration and the pipeline configuration is invalid.\n");
-			exit(EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit ("VIDIOC_STREAMON");
+			return errno_report (cam, "VIDIOC_STREAMON");
 		}
 	}
+
+	return 0;
 }
 
 
-// close video capture device
-void camClose(Camera * cam)
+// Stop streaming and close the device, as far as it got opened. Errors are
+// ignored, the device may be gone already.
+static void v4l2Stop(Camera * cam)
 {
 	//printf("Stopping camera capture\n");
 
+	if (cam->handle == -1) {
+		return;
+	}
+	epoll_ctl (cam->wait_fd, EPOLL_CTL_DEL, cam->handle, NULL);
+
 	// stop capturing
 	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl (cam, VIDIOC_STREAMOFF, &type)){
-		errno_exit ("VIDIOC_STREAMOFF");
-	}
+	xioctl (cam, VIDIOC_STREAMOFF, &type);
 
 
 	//printf("Uninitialising device\n");
 
 	// uninitialise the device
 	for (unsigned int i = 0; i < cam->n_buffers; ++i){
-		if(-1 == munmap(cam->buffers[i].start, cam->buffers[i].buf.length)){
-			errno_exit("munmap");
-		}
+		munmap(cam->buffers[i].start, cam->buffers[i].buf.length);
 	}
 	
 	// free buffers
 	free (cam->buffers);
+	cam->buffers = NULL;
+	cam->n_buffers = 0;
 	
 	//printf("Closing device\n");
 
 	// close the device
-	if (-1 == close(cam->handle)){
-		errno_exit ("close");
-	}
-
-	free(cam);
+	close (cam->handle);
 	cam->handle = -1;
 }
 
 
-// Open a video capture device
-Camera * camOpen(unsigned int width, unsigned int height)
+// Open the device, set it up and start streaming. Returns -1 with the
+// device closed again when it cannot be used.
+static int v4l2Start(Camera * cam)
 {
-	//printf("Opening the device\n");
-	
+	V4l2 * v4l2 = cam->priv;
 
-	char * dev_name = "/dev/video0";
+	//printf("Opening the device\n");
 
 	
 	// initialise the device
 	struct stat st; 
 
-	if (-1 == stat (dev_name, &st)) {
+	if (-1 == stat (cam->name, &st)) {
 		fprintf (stderr, "Cannot identify '%s': %d, %s\n",
-			dev_name, errno, strerror (errno));
-		exit (EXIT_FAILURE);
+			cam->name, errno, strerror (errno));
+		return -1;
 	}
 
 	if (!S_ISCHR (st.st_mode)) {
-		fprintf (stderr, "%s is no device\n", dev_name);
-		exit (EXIT_FAILURE);
+		fprintf (stderr, "%s is no device\n", cam->name);
+		return -1;
 	}
 
 	
-	// set up the device
-	Camera * cam = malloc(sizeof(*cam));
-	if(cam == NULL){
-		fprintf(stderr, "Could not allocate memory for device structure\n");
-		exit(EXIT_FAILURE);
-	}
-	
 	// open the device
-	cam->handle = open(dev_name, O_RDWR | O_NONBLOCK, 0);
-	cam->name = dev_name;
+	cam->handle = open(cam->name, O_RDWR | O_NONBLOCK, 0);
 
 	if (-1 == cam->handle) {
 		fprintf (stderr, "Cannot open '%s': %d, %s\n",
-			 dev_name, errno, strerror (errno));
-		exit (EXIT_FAILURE);
+			 cam->name, errno, strerror (errno));
+		return -1;
 	}
 	
 	
@@ -404,17 +867,19 @@ Camera * camOpen(unsigned int width, unsigned int height)
 		if (EINVAL == errno) {
 			fprintf (stderr, "%s is no V4L2 device\n",
 					 cam->name);
-			exit (EXIT_FAILURE);
 		} else {
-				errno_exit ("VIDIOC_QUERYCAP");
+			errno_report (cam, "VIDIOC_QUERYCAP");
 		}
+		v4l2Stop (cam);
+		return -1;
 	}
 
 	// check capture capable
 	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
 		fprintf (stderr, "%s is no video capture device\n",
 					 cam->name);
-		exit (EXIT_FAILURE);
+		v4l2Stop (cam);
+		return -1;
 	}
 
 
@@ -422,13 +887,295 @@ Camera * camOpen(unsigned int width, unsigned int height)
 	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 		fprintf (stderr, "%s does not support streaming i/o\n",
 			 cam->name);
-		exit (EXIT_FAILURE);
+		v4l2Stop (cam);
+		return -1;
 	}
 	
 	
 	// Set the Camera's format
-	camSetFormat(cam, width, height);
+	struct epoll_event ev = { EPOLLIN, { .fd = cam->handle } };
+
+	if (camSetFormat(cam, v4l2->width, v4l2->height, v4l2->prefer) != 0) {
+		v4l2Stop (cam);
+		return -1;
+	}
+
+	// a camera opened again has to give the frames it was first set up
+	// with, the regions, the motion gate and recordings all assume them
+	if (v4l2->got_format == 0) {
+		v4l2->got_width = cam->width;
+		v4l2->got_height = cam->height;
+		v4l2->got_stride = cam->stride;
+		v4l2->got_format = cam->pixelformat;
+	} else if (cam->width != v4l2->got_width || cam->height != v4l2->got_height ||
+		   cam->stride != v4l2->got_stride || cam->pixelformat != v4l2->got_format) {
+		fprintf (stderr, "%s: came back as %ux%u %.4s instead of %ux%u %.4s\n", cam->name,
+			 cam->width, cam->height, (const char *)&cam->pixelformat,
+			 v4l2->got_width, v4l2->got_height, (const char *)&v4l2->got_format);
+		cam->width = v4l2->got_width;
+		cam->height = v4l2->got_height;
+		cam->stride = v4l2->got_stride;
+		cam->pixelformat = v4l2->got_format;
+		v4l2Stop (cam);
+		return -1;
+	}
+
+	if (epoll_ctl (cam->wait_fd, EPOLL_CTL_ADD, cam->handle, &ev) != 0) {
+		v4l2Stop (cam);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Find the USB device of the video node through sysfs: the node's device is
+// a USB interface, the device is the first directory above it with a bus
+// number. Leaves the path empty for cameras that are not on USB.
+static void v4l2FindUsb(Camera * cam, char * usb)
+{
+	char node[PATH_MAX];
+	char link[PATH_MAX + 64];
+	char file[PATH_MAX + 16];
+	char * slash;
+
+	usb[0] = 0;
+	if (realpath (cam->name, node) == NULL) {
+		return;
+	}
+	snprintf (link, sizeof (link), "/sys/class/video4linux/%s/device", strrchr (node, '/') + 1);
+	if (realpath (link, usb) == NULL) {
+		usb[0] = 0;
+		return;
+	}
+
+	while ((slash = strrchr (usb, '/')) != NULL && slash != usb) {
+		snprintf (file, sizeof (file), "%s/busnum", usb);
+		if (access (file, R_OK) == 0) {
+			return;
+		}
+		*slash = 0;
+	}
+	usb[0] = 0;
+}
+
+
+// read a number from a sysfs file, -1 if there is none
+static int sysfsNumber(const char * dir, const char * name)
+{
+	char file[PATH_MAX + 16];
+	int n = -1;
+
+	snprintf (file, sizeof (file), "%s/%s", dir, name);
+	FILE * fp = fopen (file, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fscanf (fp, "%d", &n) != 1) {
+		n = -1;
+	}
+	fclose (fp);
+	return n;
+}
+
+
+// Send the camera's USB device a port reset, as usbreset does, at whatever
+// bus and device number it has now. The video node goes away and comes back.
+static void v4l2ResetUsb(Camera * cam)
+{
+	V4l2 * v4l2 = cam->priv;
+	char dev[64];
+
+	if (!v4l2->usb[0]) {
+		return;
+	}
+
+	int bus = sysfsNumber (v4l2->usb, "busnum");
+	int devnum = sysfsNumber (v4l2->usb, "devnum");
+	if (bus < 0 || devnum < 0) {
+		fprintf (stderr, "%s: USB device %s is gone\n", cam->name, v4l2->usb);
+		return;
+	}
+	snprintf (dev, sizeof (dev), "/dev/bus/usb/%03d/%03d", bus, devnum);
+
+	int fd = open (dev, O_WRONLY | O_CLOEXEC);
+	if (fd == -1 || ioctl (fd, USBDEVFS_RESET, 0) == -1) {
+		fprintf (stderr, "%s: cannot reset %s: %d, %s\n", cam->name, dev, errno, strerror (errno));
+	} else {
+		fprintf (stderr, "%s: reset %s\n", cam->name, dev);
+	}
+	if (fd != -1) {
+		close (fd);
+	}
+}
+
+
+// take the next recovery step in the given number of seconds, 0 for straight away
+static void v4l2Arm(V4l2 * v4l2, unsigned int seconds)
+{
+	struct itimerspec its;
+
+	memset (&its, 0, sizeof (its));
+	its.it_value.tv_sec = seconds;
+	its.it_value.tv_nsec = seconds ? 0 : 1;
+	timerfd_settime (v4l2->timer_fd, 0, &its, NULL);
+}
+
+
+// Lose the stream: close the device and reset it straight away. Nothing
+// borrowed from it may be held.
+static void v4l2Fail(Camera * cam)
+{
+	V4l2 * v4l2 = cam->priv;
+
+	if (v4l2->state != V4L2_STREAMING) {
+		return;
+	}
+	fprintf (stderr, "%s: lost the camera, recovering\n", cam->name);
+	v4l2Stop (cam);
+	v4l2->state = V4L2_RESET;
+	v4l2->attempts = 0;
+	v4l2->backoff = 0;
+	v4l2Arm (v4l2, 0);
+}
+
+
+// One step of a recovery, when its timer is due: reset the USB device and
+// wait for it to come back, or open the device again. An attempt that fails
+// waits twice as long as the last before the next reset.
+static void v4l2Step(Camera * cam)
+{
+	V4l2 * v4l2 = cam->priv;
+	uint64_t expirations;
+
+	if (read (v4l2->timer_fd, &expirations, sizeof (expirations)) != sizeof (expirations)) {
+		return;
+	}
+
+	if (v4l2->state == V4L2_RESET) {
+		v4l2ResetUsb (cam);
+		v4l2->state = V4L2_REOPEN;
+		v4l2Arm (v4l2, CAM_SETTLE);
+		return;
+	}
+
+	v4l2->attempts++;
+	if (v4l2Start (cam) == 0) {
+		fprintf (stderr, "%s: recovered after %u attempt%s\n", cam->name,
+			 v4l2->attempts, v4l2->attempts == 1 ? "" : "s");
+		v4l2->state = V4L2_STREAMING;
+		__atomic_store_n (&cam->recoveries, cam->recoveries + 1, __ATOMIC_RELAXED);
+		v4l2FindUsb (cam, v4l2->usb);
+
+		// it runs at the rate it was asked for last
+		if (v4l2->fps) {
+			v4l2SetRate (cam, v4l2->fps);
+		}
+		return;
+	}
 
+	v4l2->backoff = v4l2->backoff ? v4l2->backoff * 2 : 1;
+	if (v4l2->backoff > CAM_BACKOFF_MAX) {
+		v4l2->backoff = CAM_BACKOFF_MAX;
+	}
+	fprintf (stderr, "%s: attempt %u failed, next in %u s\n", cam->name, v4l2->attempts, v4l2->backoff);
+	v4l2->state = V4L2_RESET;
+	v4l2Arm (v4l2, v4l2->backoff);
+}
+
+
+// close video capture device
+static void v4l2Close(Camera * cam)
+{
+	V4l2 * v4l2 = cam->priv;
+
+	v4l2Stop (cam);
+	close (v4l2->timer_fd);
+	close (cam->wait_fd);
+	free (v4l2);
+}
+
+
+static const struct FrameSource v4l2_source = {
+	"v4l2",
+	v4l2Borrow,
+	v4l2Release,
+	v4l2Close,
+	v4l2SetRate,
+	v4l2Fail
+};
+
+
+// close the camera, whatever its source
+void camClose(Camera * cam)
+{
+	cam->source->close(cam);
+	free(cam);
+}
+
+
+// Open the default video capture device
+Camera * camOpen(unsigned int width, unsigned int height)
+{
+	return camOpenDevice("/dev/video0", width, height);
+}
+
+
+// Open a video capture device in the first format it offers
+Camera * camOpenDevice(const char * dev_name, unsigned int width, unsigned int height)
+{
+	return camOpenDeviceFormat(dev_name, width, height, 0);
+}
+
+
+// Open a video capture device in the given V4L2 pixel format if it offers
+// it, 0 or one it does not offer takes the first it does. Returns NULL if
+// the device cannot be used. Once open, a device that fails is recovered
+// in the background of camTryBorrowFrame, which has no frames meanwhile.
+Camera * camOpenDeviceFormat(const char * dev_name, unsigned int width, unsigned int height, unsigned int pixelformat)
+{
+	// set up the device
+	Camera * cam = calloc(1, sizeof(*cam));
+	V4l2 * v4l2 = calloc(1, sizeof(*v4l2));
+	if(cam == NULL || v4l2 == NULL){
+		fprintf(stderr, "Could not allocate memory for device structure\n");
+		free(cam);
+		free(v4l2);
+		return NULL;
+	}
+
+	cam->handle = -1;
+	cam->name = (char *)dev_name;
+	cam->source = &v4l2_source;
+	cam->priv = v4l2;
+	v4l2->state = V4L2_STREAMING;
+	v4l2->width = width;
+	v4l2->height = height;
+	v4l2->prefer = pixelformat;
+
+	// the device and the recovery timer are waited on together
+	struct epoll_event ev = { EPOLLIN, { .fd = -1 } };
+
+	cam->wait_fd = epoll_create1(EPOLL_CLOEXEC);
+	v4l2->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ev.data.fd = v4l2->timer_fd;
+	if(cam->wait_fd == -1 || v4l2->timer_fd == -1 ||
+	   epoll_ctl(cam->wait_fd, EPOLL_CTL_ADD, v4l2->timer_fd, &ev) != 0){
+		fprintf(stderr, "%s: cannot wait on the device: %d, %s\n", dev_name, errno, strerror(errno));
+		if(v4l2->timer_fd != -1) close(v4l2->timer_fd);
+		if(cam->wait_fd != -1) close(cam->wait_fd);
+		free(cam);
+		free(v4l2);
+		return NULL;
+	}
+
+	if(v4l2Start(cam) != 0){
+		v4l2Close(cam);
+		free(cam);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &cam->last_frame);
+	v4l2FindUsb(cam, v4l2->usb);
 
 	return cam;
 }
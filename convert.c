@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNEL
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL
+#endif
+
+#include "imgproc.h"
+
+
+// Reference YUYV to RGB conversion, every other kernel must match it bit for bit.
+// Samples are read as unsigned bytes, which is what the Pi has always done.
+void yuyvToRgbRef(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	// iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB
+	for(uint32_t i = 0, j = 0; i < (pixels * 2); i+=4, j+=6){
+		const unsigned char * buffer_pos = buffer_ptr + i;
+		unsigned char * img_pos = img_ptr + j;
+
+
+		// YCbCr to RGB conversion (from: http://www.equasys.de/colorconversion.html);
+		int y0 = buffer_pos[0];
+		int cb = buffer_pos[1];
+		int y1 = buffer_pos[2];
+		int cr = buffer_pos[3];
+		int r;
+		int g;
+		int b;
+
+		// first RGB
+		r = y0 + ((357 * cr) >> 8) - 179;
+
+		g = y0 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+		b = y0 + ((450 * cb) >> 8) - 226;
+		// clamp to 0 to 255
+		img_pos[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
+		img_pos[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
+		img_pos[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
+
+		// second RGB
+		r = y1 + ((357 * cr) >> 8) - 179;
+		g = y1 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+		b = y1 + ((450 * cb) >> 8) - 226;
+		img_pos[5] = r > 254 ? 255 : (r < 0 ? 0 : r);
+		img_pos[4] = g > 254 ? 255 : (g < 0 ? 0 : g);
+		img_pos[3] = b > 254 ? 255 : (b < 0 ? 0 : b);
+	}
+}
+
+
+#ifdef HAVE_SSE2_KERNEL
+// 8 pixels per iteration. (k * c) >> 8 is computed exactly as the high half
+// of (c << 8) * k, every intermediate fits in 16 bits and packus does the clamp.
+__attribute__((target("sse2")))
+static void yuyvToRgbSse2(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+	const __m128i lo_word = _mm_set1_epi32(0x0000ffff);
+	unsigned int n = pixels & ~7u;
+	uint8_t r[16], g[16], b[16];
+
+	for(unsigned int i = 0; i < n; i += 8){
+		__m128i in = _mm_loadu_si128((const __m128i *)(buffer_ptr + i * 2));
+
+		// split luma and chroma, then give every pixel its pair's chroma
+		__m128i y = _mm_and_si128(in, lo_byte);
+		__m128i c = _mm_srli_epi16(in, 8);
+		__m128i cb = _mm_and_si128(c, lo_word);
+		__m128i cr = _mm_srli_epi32(c, 16);
+		cb = _mm_or_si128(cb, _mm_slli_epi32(cb, 16));
+		cr = _mm_or_si128(cr, _mm_slli_epi32(cr, 16));
+		cb = _mm_slli_epi16(cb, 8);
+		cr = _mm_slli_epi16(cr, 8);
+
+		__m128i vr = _mm_add_epi16(y, _mm_mulhi_epu16(cr, _mm_set1_epi16(357)));
+		vr = _mm_sub_epi16(vr, _mm_set1_epi16(179));
+
+		__m128i vg = _mm_sub_epi16(y, _mm_mulhi_epu16(cb, _mm_set1_epi16(87)));
+		vg = _mm_sub_epi16(vg, _mm_mulhi_epu16(cr, _mm_set1_epi16(181)));
+		vg = _mm_add_epi16(vg, _mm_set1_epi16(44 + 91));
+
+		__m128i vb = _mm_add_epi16(y, _mm_mulhi_epu16(cb, _mm_set1_epi16(450)));
+		vb = _mm_sub_epi16(vb, _mm_set1_epi16(226));
+
+		_mm_storeu_si128((__m128i *)r, _mm_packus_epi16(vr, vr));
+		_mm_storeu_si128((__m128i *)g, _mm_packus_epi16(vg, vg));
+		_mm_storeu_si128((__m128i *)b, _mm_packus_epi16(vb, vb));
+
+		// SSE2 has no byte shuffle, interleave to BGR with plain stores
+		unsigned char * img_pos = img_ptr + i * 3;
+		for(unsigned int k = 0; k < 8; k++){
+			img_pos[k * 3 + 0] = b[k];
+			img_pos[k * 3 + 1] = g[k];
+			img_pos[k * 3 + 2] = r[k];
+		}
+	}
+
+	yuyvToRgbRef(buffer_ptr + n * 2, img_ptr + n * 3, pixels - n);
+}
+#endif
+
+
+#ifdef HAVE_NEON_KERNEL
+// 16 pixels per iteration. The coefficients above 255 are split as
+// 357 = 256 + 101 and 450 = 256 + 194 so every product is a u8 x u8 multiply.
+static void yuyvToRgbNeon(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	unsigned int n = pixels & ~15u;
+
+	for(unsigned int i = 0; i < n; i += 16){
+		// val[0] even luma, val[1] cb, val[2] odd luma, val[3] cr
+		uint8x8x4_t in = vld4_u8(buffer_ptr + i * 2);
+		uint8x8_t cb = in.val[1];
+		uint8x8_t cr = in.val[3];
+
+		int16x8_t dr = vreinterpretq_s16_u16(vaddq_u16(vmovl_u8(cr),
+				vshrq_n_u16(vmull_u8(cr, vdup_n_u8(101)), 8)));
+		dr = vsubq_s16(dr, vdupq_n_s16(179));
+
+		int16x8_t dg = vreinterpretq_s16_u16(vaddq_u16(
+				vshrq_n_u16(vmull_u8(cb, vdup_n_u8(87)), 8),
+				vshrq_n_u16(vmull_u8(cr, vdup_n_u8(181)), 8)));
+		dg = vsubq_s16(vdupq_n_s16(44 + 91), dg);
+
+		int16x8_t db = vreinterpretq_s16_u16(vaddq_u16(vmovl_u8(cb),
+				vshrq_n_u16(vmull_u8(cb, vdup_n_u8(194)), 8)));
+		db = vsubq_s16(db, vdupq_n_s16(226));
+
+		int16x8_t y0 = vreinterpretq_s16_u16(vmovl_u8(in.val[0]));
+		int16x8_t y1 = vreinterpretq_s16_u16(vmovl_u8(in.val[2]));
+
+		// saturate, then zip even and odd pixels back into order
+		uint8x8x2_t r = vzip_u8(vqmovun_s16(vaddq_s16(y0, dr)), vqmovun_s16(vaddq_s16(y1, dr)));
+		uint8x8x2_t g = vzip_u8(vqmovun_s16(vaddq_s16(y0, dg)), vqmovun_s16(vaddq_s16(y1, dg)));
+		uint8x8x2_t b = vzip_u8(vqmovun_s16(vaddq_s16(y0, db)), vqmovun_s16(vaddq_s16(y1, db)));
+
+		uint8x8x3_t out;
+		out.val[0] = b.val[0];
+		out.val[1] = g.val[0];
+		out.val[2] = r.val[0];
+		vst3_u8(img_ptr + i * 3, out);
+		out.val[0] = b.val[1];
+		out.val[1] = g.val[1];
+		out.val[2] = r.val[1];
+		vst3_u8(img_ptr + i * 3 + 24, out);
+	}
+
+	yuyvToRgbRef(buffer_ptr + n * 2, img_ptr + n * 3, pixels - n);
+}
+#endif
+
+
+typedef void (* ConvertFunc)(const unsigned char *, unsigned char *, unsigned int);
+
+static void yuyvToRgbSelect(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels);
+
+static ConvertFunc yuyv_kernel = yuyvToRgbSelect;
+static const char * yuyv_kernel_name = "none";
+
+
+// pick the fastest kernel the cpu supports, WM_YUYV_KERNEL=scalar forces the reference
+static void yuyvSelectKernel(void)
+{
+	const char * force = getenv("WM_YUYV_KERNEL");
+	int scalar = force != NULL && strcmp(force, "scalar") == 0;
+
+	yuyv_kernel_name = "scalar";
+	yuyv_kernel = yuyvToRgbRef;
+
+	if(scalar){
+		return;
+	}
+
+#ifdef HAVE_NEON_KERNEL
+	yuyv_kernel_name = "neon";
+	yuyv_kernel = yuyvToRgbNeon;
+#endif
+
+#ifdef HAVE_SSE2_KERNEL
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")){
+		yuyv_kernel_name = "sse2";
+		yuyv_kernel = yuyvToRgbSse2;
+	}
+#endif
+}
+
+
+// first call resolves the kernel and replaces itself
+static void yuyvToRgbSelect(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	yuyvSelectKernel();
+	yuyv_kernel(buffer_ptr, img_ptr, pixels);
+}
+
+
+// Convert a run of YUYV pixel pairs into 24 bit RGB (stored b, g, r)
+void yuyvToRgb(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	yuyv_kernel(buffer_ptr, img_ptr, pixels);
+}
+
+
+// Name of the kernel in use
+const char * yuyvKernelName(void)
+{
+	if(yuyv_kernel == yuyvToRgbSelect){
+		yuyvSelectKernel();
+	}
+	return yuyv_kernel_name;
+}
+
+
+// Luma of a run of YUYV pixels, every other byte
+void yuyvToLuma(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	for(unsigned int i = 0; i < pixels; i++){
+		img_ptr[i] = buffer_ptr[i * 2];
+	}
+}
+
+
+// Grey pixels as 24 bit RGB, for showing a grey camera
+void greyToRgb(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels)
+{
+	for(unsigned int i = 0; i < pixels; i++){
+		img_ptr[i * 3 + 0] = buffer_ptr[i];
+		img_ptr[i * 3 + 1] = buffer_ptr[i];
+		img_ptr[i * 3 + 2] = buffer_ptr[i];
+	}
+}
+
+
+// One pixel of a Bayer frame by bilinear interpolation: the other colours are
+// averaged from the neighbours that have them. Neighbours outside the frame
+// are taken from the other side of the pixel, which has the same colour.
+// red_x and red_y are where red sits in the 2x2 tile.
+static inline void bayerPixel(const unsigned char * src, unsigned int stride, unsigned int width, unsigned int height,
+			      unsigned int x, unsigned int y, unsigned int red_x, unsigned int red_y, unsigned char * dst)
+{
+	const unsigned char * p = src + y * stride + x;
+	int left = x > 0 ? -1 : 1;
+	int right = x + 1 < width ? 1 : -1;
+	int up = y > 0 ? -(int)stride : (int)stride;
+	int down = y + 1 < height ? (int)stride : -(int)stride;
+
+	unsigned int hn = (p[left] + p[right]) / 2;
+	unsigned int vn = (p[up] + p[down]) / 2;
+	unsigned int di = (p[up + left] + p[up + right] + p[down + left] + p[down + right]) / 4;
+
+	// channel of the row's red or blue in the b, g, r image
+	unsigned int c = ((y ^ red_y) & 1) ? 0 : 2;
+
+	if(((x + y) ^ (red_x + red_y)) & 1){
+		dst[c] = hn;
+		dst[1] = p[0];
+		dst[2 - c] = vn;
+	} else {
+		dst[c] = p[0];
+		dst[1] = (hn + vn) / 2;
+		dst[2 - c] = di;
+	}
+}
+
+
+// Reference Bayer to RGB conversion of a whole frame, one pixel at a time with
+// the borders checked on every one. bayerToRgb must match it bit for bit.
+void bayerToRgbRef(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		   unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y)
+{
+	for(unsigned int y = 0; y < height; y++){
+		for(unsigned int x = 0; x < width; x++){
+			bayerPixel(src, stride, width, height, x, y, red_x, red_y, img_ptr + (y * width + x) * 3);
+		}
+	}
+}
+
+
+// Convert one rectangle of a Bayer frame into the same place in the image
+// (stored b, g, r). Inside the frame border every neighbour is there, so the
+// rows are done a green and a red or blue pixel at a time without a single
+// test. Only the outermost rows and columns go through bayerPixel.
+void bayerToRgb(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y, const Rect * rect)
+{
+	unsigned int x1 = rect->x + rect->w;
+	unsigned int y1 = rect->y + rect->h;
+	int s = stride;
+
+	if(x1 > width) x1 = width;
+	if(y1 > height) y1 = height;
+	if(rect->x >= x1) return;
+
+	// interior columns of the rectangle
+	unsigned int xs = rect->x > 0 ? rect->x : 1;
+	unsigned int xe = x1 < width ? x1 : width - 1;
+
+	for(unsigned int y = rect->y; y < y1; y++){
+		unsigned char * row = img_ptr + y * width * 3;
+
+		if(y == 0 || y + 1 == height || xs >= xe){
+			for(unsigned int x = rect->x; x < x1; x++){
+				bayerPixel(src, stride, width, height, x, y, red_x, red_y, row + x * 3);
+			}
+			continue;
+		}
+
+		if(rect->x == 0){
+			bayerPixel(src, stride, width, height, 0, y, red_x, red_y, row);
+		}
+		if(x1 == width){
+			bayerPixel(src, stride, width, height, width - 1, y, red_x, red_y, row + (width - 1) * 3);
+		}
+
+		// the row's red or blue channel, and the parity of its green columns
+		unsigned int c = ((y ^ red_y) & 1) ? 0 : 2;
+		unsigned int green_x = (red_x + red_y + y + 1) & 1;
+		const unsigned char * p = src + y * stride + xs;
+		unsigned char * dst = row + xs * 3;
+		unsigned int x = xs;
+
+		// start on a green column
+		if((x ^ green_x) & 1){
+			unsigned int hn = (p[-1] + p[1]) / 2;
+			unsigned int vn = (p[-s] + p[s]) / 2;
+			dst[c] = p[0];
+			dst[1] = (hn + vn) / 2;
+			dst[2 - c] = (p[-s - 1] + p[-s + 1] + p[s - 1] + p[s + 1]) / 4;
+			p++;
+			dst += 3;
+			x++;
+		}
+
+		for(; x + 1 < xe; x += 2, p += 2, dst += 6){
+			// green: the row's colour left and right, the other above and below
+			dst[c] = (p[-1] + p[1]) / 2;
+			dst[1] = p[0];
+			dst[2 - c] = (p[-s] + p[s]) / 2;
+
+			// red or blue: green all round, the other colour on the diagonals
+			unsigned int hn = (p[0] + p[2]) / 2;
+			unsigned int vn = (p[1 - s] + p[1 + s]) / 2;
+			dst[3 + c] = p[1];
+			dst[4] = (hn + vn) / 2;
+			dst[5 - c] = (p[-s] + p[2 - s] + p[s] + p[2 + s]) / 4;
+		}
+
+		if(x < xe){
+			dst[c] = (p[-1] + p[1]) / 2;
+			dst[1] = p[0];
+			dst[2 - c] = (p[-s] + p[s]) / 2;
+		}
+	}
+}
+
+
+// Green of one pixel of a Bayer frame as bayerPixel has it, the sample itself
+// on a green site and the average of the four round it elsewhere
+static inline unsigned char bayerGreen(const unsigned char * src, unsigned int stride, unsigned int width,
+				       unsigned int height, unsigned int x, unsigned int y,
+				       unsigned int red_x, unsigned int red_y)
+{
+	const unsigned char * p = src + y * stride + x;
+
+	if(((x + y) ^ (red_x + red_y)) & 1){
+		return p[0];
+	}
+
+	int left = x > 0 ? -1 : 1;
+	int right = x + 1 < width ? 1 : -1;
+	int up = y > 0 ? -(int)stride : (int)stride;
+	int down = y + 1 < height ? (int)stride : -(int)stride;
+
+	return ((p[left] + p[right]) / 2 + (p[up] + p[down]) / 2) / 2;
+}
+
+
+// The brightness of one rectangle of a Bayer frame, taken as the green
+// channel of bayerToRgb: half the sites are green already and green carries
+// most of the luma. Split into border and interior the same way.
+void bayerToLuma(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		 unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y, const Rect * rect)
+{
+	unsigned int x1 = rect->x + rect->w;
+	unsigned int y1 = rect->y + rect->h;
+	int s = stride;
+
+	if(x1 > width) x1 = width;
+	if(y1 > height) y1 = height;
+	if(rect->x >= x1) return;
+
+	unsigned int xs = rect->x > 0 ? rect->x : 1;
+	unsigned int xe = x1 < width ? x1 : width - 1;
+
+	for(unsigned int y = rect->y; y < y1; y++){
+		unsigned char * row = img_ptr + y * width;
+
+		if(y == 0 || y + 1 == height || xs >= xe){
+			for(unsigned int x = rect->x; x < x1; x++){
+				row[x] = bayerGreen(src, stride, width, height, x, y, red_x, red_y);
+			}
+			continue;
+		}
+
+		if(rect->x == 0){
+			row[0] = bayerGreen(src, stride, width, height, 0, y, red_x, red_y);
+		}
+		if(x1 == width){
+			row[width - 1] = bayerGreen(src, stride, width, height, width - 1, y, red_x, red_y);
+		}
+
+		unsigned int green_x = (red_x + red_y + y + 1) & 1;
+		const unsigned char * p = src + y * stride + xs;
+		unsigned char * dst = row + xs;
+		unsigned int x = xs;
+
+		if((x ^ green_x) & 1){
+			*dst++ = ((p[-1] + p[1]) / 2 + (p[-s] + p[s]) / 2) / 2;
+			p++;
+			x++;
+		}
+
+		for(; x + 1 < xe; x += 2, p += 2, dst += 2){
+			dst[0] = p[0];
+			dst[1] = ((p[0] + p[2]) / 2 + (p[1 - s] + p[1 + s]) / 2) / 2;
+		}
+
+		if(x < xe){
+			dst[0] = p[0];
+		}
+	}
+}
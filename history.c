@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <history.h>
+
+// The writer appends through a shared mapping: the record goes in first and
+// the header's head moves on after it, so a reader mapping the same file
+// never sees a record that is not there yet. The kernel writes the pages back
+// in its own time; history is a convenience, the total is kept by the store.
+// Seconds are summed in memory until the next one starts, so each flowing
+// second costs one record and idle time none.
+
+struct History {
+   const char *name;
+   int fd;
+   int writable;
+   unsigned char *map;
+   size_t map_size;
+   HistHeader *header;
+   HistRecord *records;
+
+   // what histCount saw, histRecord and histFind index into it
+   uint64_t base;
+   uint64_t count;
+
+   // second being summed, not written yet
+   uint32_t pending_time;
+   double pending_litres;
+   uint32_t last_time;
+};
+
+
+// Open a history file, a writer creates it with room for capacity records if
+// it is missing or not a history. An existing history keeps its own capacity.
+// Returns NULL if the file cannot be used.
+History *histOpen(const char *file, uint32_t capacity, int writable) {
+   History *h;
+   struct stat st;
+   HistHeader header;
+
+   h = calloc(1, sizeof(*h));
+   if (!h) return NULL;
+   h->name = file;
+   h->writable = writable;
+
+   h->fd = open(file, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+   if (h->fd == -1 || fstat(h->fd, &st) == -1) {
+      fprintf(stderr, "Error: could not open %s: %s\n", file, strerror(errno));
+      fflush(stderr);
+      if (h->fd != -1) close(h->fd);
+      free(h);
+      return NULL;
+   }
+
+   if (st.st_size < HIST_DATA_OFFSET || pread(h->fd, &header, sizeof(header), 0) != sizeof(header) ||
+       memcmp(header.magic, HIST_MAGIC, sizeof(header.magic)) != 0 ||
+       header.record_size != sizeof(HistRecord) || header.capacity < 2 ||
+       st.st_size < HIST_DATA_OFFSET + (off_t)header.capacity * sizeof(HistRecord)) {
+
+      if (!writable) {
+         fprintf(stderr, "Error: %s is not a flow history\n", file);
+         fflush(stderr);
+         close(h->fd);
+         free(h);
+         return NULL;
+      }
+
+      // start a new one, the records are allocated up front
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, HIST_MAGIC, sizeof(header.magic));
+      header.capacity = capacity;
+      header.record_size = sizeof(HistRecord);
+      if (ftruncate(h->fd, 0) == -1 ||
+          posix_fallocate(h->fd, 0, HIST_DATA_OFFSET + (off_t)capacity * sizeof(HistRecord)) != 0 ||
+          pwrite(h->fd, &header, sizeof(header), 0) != sizeof(header)) {
+         fprintf(stderr, "Error: could not create %s: %s\n", file, strerror(errno));
+         fflush(stderr);
+         close(h->fd);
+         free(h);
+         return NULL;
+      }
+   }
+
+   h->map_size = HIST_DATA_OFFSET + (size_t)header.capacity * sizeof(HistRecord);
+   h->map = mmap(NULL, h->map_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, h->fd, 0);
+   if (h->map == MAP_FAILED) {
+      fprintf(stderr, "Error: could not map %s: %s\n", file, strerror(errno));
+      fflush(stderr);
+      close(h->fd);
+      free(h);
+      return NULL;
+   }
+   h->header = (HistHeader *)h->map;
+   h->records = (HistRecord *)(h->map + HIST_DATA_OFFSET);
+
+   if (histCount(h)) h->last_time = histRecord(h, histCount(h) - 1)->time;
+   return h;
+}
+
+static void histAppend(History *h, uint32_t time, float litres) {
+   uint64_t head = h->header->head;
+   HistRecord *rec = &h->records[head % h->header->capacity];
+
+   rec->time = time;
+   rec->litres = litres;
+   __atomic_store_n(&h->header->head, head + 1, __ATOMIC_RELEASE);
+   h->last_time = time;
+}
+
+// Account litres flowed at the given second. Time never goes back in the
+// history, a clock set back counts on from the last second seen.
+void histAdd(History *h, time_t time, double litres) {
+   uint32_t t = (uint32_t)time;
+   uint32_t last = h->pending_litres > 0.0 ? h->pending_time : h->last_time;
+
+   if (t < last) t = last;
+
+   if (h->pending_litres > 0.0 && t != h->pending_time) histFlush(h);
+   if (h->pending_litres == 0.0) h->pending_time = t;
+   h->pending_litres += litres;
+}
+
+// Write the second being summed
+void histFlush(History *h) {
+   if (h->pending_litres > 0.0) histAppend(h, h->pending_time, h->pending_litres);
+   h->pending_litres = 0.0;
+}
+
+void histClose(History *h) {
+   if (h->writable) histFlush(h);
+   munmap(h->map, h->map_size);
+   close(h->fd);
+   free(h);
+}
+
+// Records that can be read now. Records written later are not seen until
+// the next call. The oldest is left out once the ring has wrapped, as a
+// writer may be overwriting it.
+uint64_t histCount(History *h) {
+   uint64_t head = __atomic_load_n(&h->header->head, __ATOMIC_ACQUIRE);
+
+   h->count = head < h->header->capacity ? head : h->header->capacity - 1;
+   h->base = head - h->count;
+   return h->count;
+}
+
+// Record i of histCount, oldest first
+const HistRecord *histRecord(History *h, uint64_t i) {
+   return &h->records[(h->base + i) % h->header->capacity];
+}
+
+// Index of the first record at or after time, histCount if there is none
+uint64_t histFind(History *h, time_t time) {
+   uint64_t lo = 0, hi = h->count;
+
+   while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (histRecord(h, mid)->time < time) lo = mid + 1;
+      else hi = mid;
+   }
+   return lo;
+}
@@ -0,0 +1,39 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Flow history: a fixed-size ring of per-second records, one for every second
+// water flowed, oldest overwritten first. The file is a HistHeader padded to
+// HIST_DATA_OFFSET and then capacity HistRecords, record n of all those ever
+// written at n % capacity.
+#define HIST_MAGIC        "WMHIST1"
+#define HIST_DATA_OFFSET  4096
+// 8 MiB, over a year of a household's flow
+#define HIST_RECORDS      (1u << 20)
+
+typedef struct {
+   char magic[8];
+   uint32_t capacity;         // records
+   uint32_t record_size;
+   uint64_t head;             // records ever written, updated after the record
+} HistHeader;
+
+typedef struct {
+   uint32_t time;             // wall clock second
+   float litres;              // flowed in that second
+} HistRecord;
+
+typedef struct History History;
+
+History *histOpen(const char *file, uint32_t capacity, int writable);
+void histAdd(History *h, time_t time, double litres);
+void histFlush(History *h);
+void histClose(History *h);
+
+uint64_t histCount(History *h);
+const HistRecord *histRecord(History *h, uint64_t i);
+uint64_t histFind(History *h, time_t time);
+
+#endif // _HISTORY_H_
@@ -1,16 +1,113 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <SDL/SDL.h>
 
 #include "imgproc.h"
 
 
+// image data is aligned to a cache line, which also suits the SIMD loads
+#define IMG_ALIGN	64
+
+// number of released images kept around for reuse
+#define IMG_POOL_SIZE	8
+
+
+// released images, ready to be handed out again by imgNew
+static Image * pool[IMG_POOL_SIZE];
+static unsigned int pool_count = 0;
+static ImgPoolStats pool_stats;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// take an image of the given size and format from the pool, NULL if there is none
+static Image * poolGet(unsigned int width, unsigned int height, ImgFormat format)
+{
+	Image * img = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	for(unsigned int i = 0; i < pool_count; i++){
+		if(pool[i]->width == width && pool[i]->height == height && pool[i]->format == format){
+			img = pool[i];
+			pool[i] = pool[--pool_count];
+			break;
+		}
+	}
+	if(img != NULL){
+		pool_stats.hits++;
+		if(++pool_stats.in_use > pool_stats.high_water){
+			pool_stats.high_water = pool_stats.in_use;
+		}
+	} else {
+		pool_stats.misses++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return img;
+}
+
+
+// account for a freshly allocated image handed out by imgNew
+static void poolAdopt(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	if(++pool_stats.in_use > pool_stats.high_water){
+		pool_stats.high_water = pool_stats.in_use;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+// give an image back to the pool, returns 0 if the pool is full
+static int poolPut(Image * img)
+{
+	int kept = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stats.in_use--;
+	if(pool_count < IMG_POOL_SIZE){
+		pool[pool_count++] = img;
+		kept = 1;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return kept;
+}
+
+
+// free an image and everything it owns
+static void imgFree(Image * img)
+{
+	// Free the SDL surface, luma images have none
+	if(img->sdl_surface != NULL){
+		SDL_FreeSurface(img->sdl_surface);
+	}
+	if(img->mem_ptr != NULL){
+		free(img->mem_ptr);
+	}
+	// Free the image container, Python will handle the memoryview + buffer
+	free(img);
+}
+
+
 Image * imgNew(unsigned int width, unsigned int height)
 {
+	return imgNewFormat(width, height, IMG_RGB);
+}
+
+
+Image * imgNewFormat(unsigned int width, unsigned int height, ImgFormat format)
+{
+	// Reuse a released image of the same size if there is one
+	Image * img = poolGet(width, height, format);
+	if(img != NULL){
+		return img;
+	}
+
 	// Allocate for the image container
-	Image * img = malloc(sizeof(*img));
+	img = malloc(sizeof(*img));
 	if(img == NULL){
 		fprintf(stderr, "Failed to allocate memory for image container\n");
 		return NULL;
@@ -19,24 +116,32 @@ Image * imgNew(unsigned int width, unsigned int height)
 	// Set the width and height
 	img->width = width;
 	img->height = height;
+	img->format = format;
+	img->bpp = format == IMG_LUMA ? 1 : 3;
 
-	// allocate for image data, 3 byte per pixel, aligned to an 8 byte boundary
-	img->mem_ptr = malloc(img->width * img->height * 3 + 8);
+	// allocate for image data, aligned to IMG_ALIGN bytes
+	img->mem_ptr = malloc(img->width * img->height * img->bpp + IMG_ALIGN);
 	if(img->mem_ptr == NULL){
 		fprintf(stderr, "Memory allocation of image data failed\n");
 		free(img);
 		return NULL;
 	}
 
-	// make certain it is aligned to 8 bytes
-	unsigned int remainder = ((size_t)img->mem_ptr) % 8;
+	// make certain it is aligned to IMG_ALIGN bytes
+	unsigned int remainder = ((size_t)img->mem_ptr) % IMG_ALIGN;
 	if(remainder == 0){
 		img->data = img->mem_ptr;
 	} else {
-		img->data = img->mem_ptr + (8 - remainder);
+		img->data = img->mem_ptr + (IMG_ALIGN - remainder);
+	}
+
+	// only colour images can be shown
+	if(format == IMG_LUMA){
+		img->sdl_surface = NULL;
+		poolAdopt();
+		return img;
 	}
 
-	
 	// Fill the SDL_Surface container
 	img->sdl_surface = SDL_CreateRGBSurfaceFrom(
 				img->data,
@@ -60,6 +165,7 @@ Image * imgNew(unsigned int width, unsigned int height)
 	}
 
 	// return the image
+	poolAdopt();
 	return img;
 }
 
@@ -84,6 +190,8 @@ Image * imgFromBitmap(const char * filename)
 	// Set the width and height
 	img->width = bitmap->w;
 	img->height = bitmap->h;
+	img->format = IMG_RGB;
+	img->bpp = 3;
 
 	// set the data pointer
 	img->data = bitmap->pixels;	
@@ -100,10 +208,13 @@ Image * imgFromBitmap(const char * filename)
 Image * imgCopy(Image * img)
 {
 	// Create a new empty image
-	Image * copy = imgNew(img->width, img->height);
+	Image * copy = imgNewFormat(img->width, img->height, img->format);
+	if(copy == NULL){
+		return NULL;
+	}
 
 	// Copy the data between the images
-	copy = memcpy(copy->data, img->data, img->width * img->height * 3 );
+	memcpy(copy->data, img->data, img->width * img->height * img->bpp);
 
 	// return the copy
 	return copy;	
@@ -125,7 +236,13 @@ unsigned int imgGetHeight(Image * img)
 void imgSetPixel(Image * img, unsigned int x, unsigned int y, char r, char g, char b)
 {
 	// calculate the offset into the image array
-	uint32_t offset = 3 * (x + (y * img->width));
+	uint32_t offset = img->bpp * (x + (y * img->width));
+
+	// a luma image gets the brightness, the same whichever way round r and b are
+	if(img->format == IMG_LUMA){
+		img->data[offset] = ((unsigned char)r + 2 * (unsigned char)g + (unsigned char)b) / 4;
+		return;
+	}
 	// set the rgb value
 	img->data[offset + 2] = b;
 	img->data[offset + 1] = g;
@@ -133,23 +250,39 @@ void imgSetPixel(Image * img, unsigned int x, unsigned int y, char r, char g, ch
 }
 
 
-// returns a pointer to the rgb tuple
+// returns a pointer to the rgb tuple, or the luma byte
 char * imgGetPixel(Image * img, unsigned int x, unsigned int y)
 {
-	uint32_t offset = 3 * (x + (y * img->width));
+	uint32_t offset = img->bpp * (x + (y * img->width));
 	return (char *)(img->data + offset);
 }
 
 
-// Destroys the image
+// Destroys the image, images from imgNew go back to the pool when there is room
 void imgDestroy(Image * img)
 {
-	// Free the SDL surface
-	SDL_FreeSurface(img->sdl_surface);
-	if(img->mem_ptr != NULL){
-		free(img->mem_ptr);
+	// bitmaps own their pixels through SDL and are never pooled
+	if(img->mem_ptr == NULL || !poolPut(img)){
+		imgFree(img);
 	}
-	// Free the image container, Python will handle the memoryview + buffer
-	free(img);
 }
 
+
+// Read the pool counters
+void imgPoolStats(ImgPoolStats * stats)
+{
+	pthread_mutex_lock(&pool_lock);
+	*stats = pool_stats;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+// Free every image held by the pool
+void imgPoolDrain(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	while(pool_count > 0){
+		imgFree(pool[--pool_count]);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -1,27 +1,55 @@
 #ifndef _IMGPROC_H_
 #define _IMGPROC_H_
 
+#include <stdint.h>
+#include <sys/time.h>
+
 #include <SDL/SDL.h>
 
 
 // forward declarations of internal types
 struct Buffer;
+struct FrameSource;
 
 
 typedef struct {
 	unsigned int width;
 	unsigned int height;
+	unsigned int stride;
+	unsigned int pixelformat;
 
 	char * name;
 	int handle;
+	// becomes readable when a frame may be ready, for poll/epoll
+	int wait_fd;
 	struct Buffer * buffers;
 	unsigned int n_buffers;
+
+	// where the frames come from, and that source's private state
+	const struct FrameSource * source;
+	void * priv;
+
+	// times the camera was lost and came back, stored atomically by
+	// whichever thread borrows its frames
+	unsigned long recoveries;
+	// when it last gave a frame or was given up on, for camPollOverdue
+	struct timespec last_frame;
 } Camera;
 
 
+// what an image holds per pixel. Detection only needs the brightness, so
+// only images that are shown are converted to colour.
+typedef enum {
+	IMG_RGB,	// 3 bytes, stored b, g, r
+	IMG_LUMA	// 1 byte of brightness, no SDL surface
+} ImgFormat;
+
+
 typedef struct {
 	unsigned int width;
 	unsigned int height;
+	ImgFormat format;
+	unsigned int bpp;	// bytes per pixel
 	char * data;
 	char * mem_ptr;
 	
@@ -29,6 +57,30 @@ typedef struct {
 } Image;
 
 
+// image pool counters, high_water is the most images in use at once
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned int in_use;
+	unsigned int high_water;
+} ImgPoolStats;
+
+
+// read only view of a captured frame, borrowed from the camera
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	unsigned int pixelformat;
+	unsigned int sequence;
+	struct timeval timestamp;
+	unsigned int bytesused;
+	const unsigned char * data;
+
+	unsigned int index;
+} Frame;
+
+
 typedef struct {
 	unsigned int width;
 	unsigned int height;
@@ -36,6 +88,55 @@ typedef struct {
 } Viewer;
 
 
+// Recording file layout: a RecHeader, then per frame a RecFrame followed by
+// bytesused bytes of data padded to 8 bytes, then the index of n_frames file
+// offsets. A recording that was not closed has no index (index_offset 0).
+#define REC_MAGIC	"WMREC01"
+
+typedef struct {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixelformat;
+	uint32_t stride;
+	uint32_t n_frames;
+	uint32_t reserved;
+	uint64_t index_offset;
+} RecHeader;
+
+typedef struct {
+	uint32_t sequence;
+	uint32_t bytesused;
+	int64_t timestamp_us;
+} RecFrame;
+
+typedef struct Recorder Recorder;
+
+
+// operations a frame source provides, camBorrowFrame etc. dispatch through
+// these. borrow never blocks: it returns 0 with a frame, 1 when no frame is
+// ready yet (wait for wait_fd) and -1 when the source has no more frames.
+// set_rate is NULL for sources whose frame rate cannot be changed. recover
+// drops the stream and gets it back in the background of borrow, it is NULL
+// for sources that cannot be recovered.
+struct FrameSource {
+	const char * name;
+	int (* borrow)(Camera * cam, Frame * frame);
+	void (* release)(Camera * cam, Frame * frame);
+	void (* close)(Camera * cam);
+	int (* set_rate)(Camera * cam, unsigned int fps);
+	void (* recover)(Camera * cam);
+};
+
+
+typedef struct {
+	unsigned int x;
+	unsigned int y;
+	unsigned int w;
+	unsigned int h;
+} Rect;
+
+
 
 /* Utility operations */
 void init_imgproc();
@@ -45,17 +146,58 @@ void waitTime(size_t milliseconds);
 
 /* Webcam operations */
 Camera * camOpen(unsigned int width, unsigned int height);
+Camera * camOpenDevice(const char * dev_name, unsigned int width, unsigned int height);
+Camera * camOpenDeviceFormat(const char * dev_name, unsigned int width, unsigned int height, unsigned int pixelformat);
+Camera * camOpenReplay(const char * filename, unsigned int width, unsigned int height, int realtime);
 unsigned int camGetWidth(Camera * cam);
 unsigned int camGetHeight(Camera * cam);
 Image * camGrabImage(Camera * cam);
+Image * camGrabImageRects(Camera * cam, const Rect * rects, unsigned int n_rects);
+int camGetFd(Camera * cam);
+int camBorrowFrame(Camera * cam, Frame * frame);
+int camTryBorrowFrame(Camera * cam, Frame * frame);
+int camSetFrameRate(Camera * cam, unsigned int fps);
+int camRecover(Camera * cam);
+int camPollOverdue(Camera * cam);
+void camReleaseFrame(Camera * cam, Frame * frame);
+int frmToImage(const Frame * frame, Image * img);
+int frmToImageRects(const Frame * frame, Image * img, const Rect * rects, unsigned int n_rects);
+unsigned int frmPixelStep(const Frame * frame);
+void frmJpegDcOnly(int dc_only);
 void camClose(Camera * cam);
 
 
+/* Recording operations */
+Recorder * recOpen(const char * filename, Camera * cam);
+int recWriteFrame(Recorder * rec, const Frame * frame);
+void recStats(Recorder * rec, unsigned long * written, unsigned long * dropped);
+void recClose(Recorder * rec);
+
+
+/* Conversion operations */
+void yuyvToRgb(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels);
+void yuyvToRgbRef(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels);
+const char * yuyvKernelName(void);
+void yuyvToLuma(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels);
+void greyToRgb(const unsigned char * buffer_ptr, unsigned char * img_ptr, unsigned int pixels);
+void bayerToRgb(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y, const Rect * rect);
+void bayerToRgbRef(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		   unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y);
+void bayerToLuma(const unsigned char * src, unsigned int stride, unsigned char * img_ptr,
+		 unsigned int width, unsigned int height, unsigned int red_x, unsigned int red_y, const Rect * rect);
+int jpegToLuma(const unsigned char * data, unsigned int size, unsigned char * img_ptr,
+	       unsigned int width, unsigned int height, const Rect * rects, unsigned int n_rects, int dc_only);
+
+
 /* Image operations */
 Image * imgNew(unsigned int width, unsigned int height);
+Image * imgNewFormat(unsigned int width, unsigned int height, ImgFormat format);
 Image * imgFromBitmap(const char * filename);
 Image * imgCopy(Image * img);
 void imgDestroy(Image * img);
+void imgPoolStats(ImgPoolStats * stats);
+void imgPoolDrain(void);
 
 unsigned int imgGetWidth(Image * img);
 unsigned int imgGetHeight(Image * img);
@@ -0,0 +1,881 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "imgproc.h"
+
+
+// Just enough of a baseline JPEG decoder for MJPEG cameras. Detection only
+// needs the luma of a few rectangles, so only the 8x8 luma blocks touching
+// them are dequantised and transformed. Every block before the last one
+// needed still has to be Huffman decoded to find where the next one starts,
+// except that a frame with restart markers lets whole intervals be skipped by
+// searching for the marker that ends them. Nothing after the last block
+// needed is looked at.
+
+// codes up to this long are decoded with one table lookup
+#define JPEG_FAST_BITS	9
+
+// components in a frame, four is all JPEG allows
+#define JPEG_COMPS	4
+
+// block masks kept for reuse, two per camera (regions and viewer) and some
+#define JPEG_MASKS	8
+
+
+typedef struct {
+	// length << 8 | symbol of codes up to JPEG_FAST_BITS long, indexed by
+	// the next JPEG_FAST_BITS bits, 0 for longer codes
+	uint16_t fast[1 << JPEG_FAST_BITS];
+	// for AC tables, the same for a code and the coefficient bits after it
+	// together: value << 8 | zero run << 4 | bits taken, 0 if longer or if
+	// the value does not fit in 8 bits
+	int16_t fast_ac[1 << JPEG_FAST_BITS];
+	// per code length, the largest code (-1 if none), the first code and
+	// where the symbols of that length start
+	int maxcode[17];
+	int mincode[17];
+	int valptr[17];
+	unsigned char values[256];
+	int defined;
+} JpegHuff;
+
+
+// entropy coded data, read through a 64 bit buffer with the next bit at the
+// top. A marker stops the reading and zeros are shifted in from there on.
+typedef struct {
+	const unsigned char * p;
+	const unsigned char * end;
+	uint64_t bits;
+	int n;
+	int marker;
+} JpegBits;
+
+
+typedef struct {
+	unsigned int id;
+	unsigned int h;
+	unsigned int v;
+	unsigned int tq;
+	// in the scan: tables, blocks per MCU across and down, DC prediction
+	unsigned int td;
+	unsigned int ta;
+	unsigned int bh;
+	unsigned int bv;
+	int pred;
+} JpegComp;
+
+
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	unsigned int n_comps;
+	unsigned int h_max;
+	unsigned int v_max;
+	JpegComp comp[JPEG_COMPS];
+	uint16_t quant[4][64];
+	JpegHuff dc[4];
+	JpegHuff ac[4];
+	unsigned int restart;
+
+	// the scan: components in MCU order and MCUs across and down
+	unsigned int scan_n;
+	JpegComp * scan[JPEG_COMPS];
+	unsigned int mcus_x;
+	unsigned int mcus_y;
+} Jpeg;
+
+
+// Which luma blocks a set of rectangles needs, and which MCUs have any. It
+// only changes with the frame geometry and the rectangles, so it is worked
+// out once and kept for the next frames like it.
+typedef struct {
+	// what it was worked out for
+	unsigned int mcus_x;
+	unsigned int mcus_y;
+	unsigned int bh;
+	unsigned int bv;
+	unsigned int width;
+	unsigned int height;
+	unsigned int n_rects;
+	Rect * rects;
+
+	unsigned char * need;
+	unsigned char * need_mcu;
+	int last;		// last MCU needed, -1 for none
+
+	unsigned char * mem;	// rects, need and need_mcu
+	size_t size;
+	int valid;
+	int busy;
+	unsigned long used;	// when last handed back, the oldest is built again
+} JpegMask;
+
+
+static JpegMask masks[JPEG_MASKS];
+static unsigned long masks_clock = 0;
+static pthread_mutex_t masks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// hand a mask back for the next frame
+static void maskPut(JpegMask * m)
+{
+	pthread_mutex_lock(&masks_lock);
+	m->busy = 0;
+	m->used = ++masks_clock;
+	pthread_mutex_unlock(&masks_lock);
+}
+
+
+// zig-zag position to row-major position, with room for a corrupt run
+static const unsigned char jpeg_natural[64 + 16] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+	63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63
+};
+
+
+// The tables of JPEG Annex K.3. MJPEG cameras leave the DHT segment out of
+// their frames and code with these.
+static const unsigned char jpeg_dc_bits[2][16] = {
+	{ 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 }
+};
+
+static const unsigned char jpeg_dc_values[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char jpeg_ac_bits[2][16] = {
+	{ 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+	{ 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 }
+};
+
+static const unsigned char jpeg_ac_values[2][162] = {
+	{
+		0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+		0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+		0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+		0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+		0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+		0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+		0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+		0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+		0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+		0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa
+	},
+	{
+		0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+		0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+		0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+		0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+		0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+		0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+		0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+		0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+		0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+		0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa
+	}
+};
+
+
+static inline unsigned int get16(const unsigned char * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+
+static inline unsigned char clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+// Build the decoding tables from the code counts per length and the symbols
+// in code order. Returns -1 for counts no Huffman code can have.
+static int huffBuild(JpegHuff * huff, const unsigned char * bits, const unsigned char * values)
+{
+	unsigned int code = 0, k = 0;
+
+	memset(huff->fast, 0, sizeof(huff->fast));
+	for(unsigned int len = 1; len <= 16; len++){
+		huff->valptr[len] = k;
+		huff->mincode[len] = code;
+		for(unsigned int i = 0; i < bits[len - 1]; i++, k++, code++){
+			huff->values[k] = values[k];
+			if(len <= JPEG_FAST_BITS){
+				unsigned int first = code << (JPEG_FAST_BITS - len);
+				for(unsigned int j = 0; j < 1u << (JPEG_FAST_BITS - len); j++){
+					huff->fast[first + j] = (len << 8) | values[k];
+				}
+			}
+		}
+		huff->maxcode[len] = bits[len - 1] ? (int)code - 1 : -1;
+		if(code > 1u << len){
+			return -1;
+		}
+		code <<= 1;
+	}
+
+	// most AC coefficients are small and follow short codes
+	memset(huff->fast_ac, 0, sizeof(huff->fast_ac));
+	for(unsigned int i = 0; i < 1u << JPEG_FAST_BITS; i++){
+		unsigned int len = huff->fast[i] >> 8;
+		unsigned int run = (huff->fast[i] >> 4) & 15;
+		unsigned int size = huff->fast[i] & 15;
+
+		if(len == 0 || size == 0 || len + size > JPEG_FAST_BITS){
+			continue;
+		}
+		int v = (i >> (JPEG_FAST_BITS - len - size)) & ((1 << size) - 1);
+		if(v < (1 << (size - 1))){
+			v -= (1 << size) - 1;
+		}
+		if(v < -128 || v > 127){
+			continue;
+		}
+		huff->fast_ac[i] = v * 256 + (run << 4) + len + size;
+	}
+	huff->defined = 1;
+	return 0;
+}
+
+
+static void bitsStart(JpegBits * b, const unsigned char * p, const unsigned char * end)
+{
+	b->p = p;
+	b->end = end;
+	b->bits = 0;
+	b->n = 0;
+	b->marker = 0;
+}
+
+
+// top the buffer up to more than 56 bits, taking out the stuffed zero after
+// every 0xff of data
+static void bitsFill(JpegBits * b)
+{
+	while(b->n <= 56){
+		unsigned int c = 0;
+
+		if(b->marker || b->p >= b->end){
+			c = 0;
+		} else if(b->p[0] != 0xff){
+			c = *b->p++;
+		} else if(b->p + 1 < b->end && b->p[1] == 0x00){
+			c = 0xff;
+			b->p += 2;
+		} else {
+			b->marker = 1;
+		}
+		b->bits |= (uint64_t)c << (56 - b->n);
+		b->n += 8;
+	}
+}
+
+
+// the next Huffman coded symbol, -1 for a code the table does not have. The
+// buffer must hold 16 bits.
+static inline int bitsSymbol(JpegBits * b, const JpegHuff * huff)
+{
+	unsigned int e = huff->fast[b->bits >> (64 - JPEG_FAST_BITS)];
+
+	if(e){
+		b->bits <<= e >> 8;
+		b->n -= e >> 8;
+		return e & 0xff;
+	}
+
+	unsigned int code = b->bits >> 48;
+	for(unsigned int len = JPEG_FAST_BITS + 1; len <= 16; len++){
+		int c = code >> (16 - len);
+		if(c <= huff->maxcode[len]){
+			b->bits <<= len;
+			b->n -= len;
+			return huff->values[huff->valptr[len] + c - huff->mincode[len]];
+		}
+	}
+	return -1;
+}
+
+
+// s more bits as a signed coefficient of that size class
+static inline int bitsValue(JpegBits * b, unsigned int s)
+{
+	if(s == 0){
+		return 0;
+	}
+
+	int v = b->bits >> (64 - s);
+	b->bits <<= s;
+	b->n -= s;
+	return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+
+// Move past the next restart marker, whatever data is left before it. Returns
+// -1 if the frame ends first.
+static int bitsRestart(JpegBits * b)
+{
+	const unsigned char * p = b->p;
+
+	while((p = memchr(p, 0xff, b->end - p)) != NULL && p + 1 < b->end){
+		if(p[1] >= 0xd0 && p[1] <= 0xd7){
+			bitsStart(b, p + 2, b->end);
+			return 0;
+		}
+		p++;
+	}
+	return -1;
+}
+
+
+// Dequantise a coefficient. Nothing a baseline encoder produces from 8 bit
+// samples comes near 2047, corrupt data is held there so that the IDCT
+// cannot overflow.
+static inline int dequant(int v, unsigned int q)
+{
+	v *= (int)q;
+	return v > 2047 ? 2047 : (v < -2047 ? -2047 : v);
+}
+
+
+// Decode one block. With coef set its coefficients are dequantised into it in
+// row-major order, otherwise they are only read past. Returns -1 for data
+// that cannot be a block.
+static int decodeBlock(JpegBits * b, Jpeg * jpeg, JpegComp * c, int * coef)
+{
+	const JpegHuff * ac = &jpeg->ac[c->ta];
+	const uint16_t * q = jpeg->quant[c->tq];
+	int s;
+
+	if(b->n < 32){
+		bitsFill(b);
+	}
+	s = bitsSymbol(b, &jpeg->dc[c->td]);
+	if(s < 0 || s > 11){
+		return -1;
+	}
+	c->pred += bitsValue(b, s);
+	if(c->pred < -2047 || c->pred > 2047){
+		return -1;
+	}
+
+	if(coef != NULL){
+		memset(coef, 0, 64 * sizeof(*coef));
+		coef[0] = dequant(c->pred, q[0]);
+	}
+
+	for(unsigned int k = 1; k < 64; k++){
+		if(b->n < 32){
+			bitsFill(b);
+		}
+
+		int f = ac->fast_ac[b->bits >> (64 - JPEG_FAST_BITS)];
+		if(f){
+			k += (f >> 4) & 15;
+			if(k > 63){
+				return -1;
+			}
+			b->bits <<= f & 15;
+			b->n -= f & 15;
+			if(coef != NULL){
+				coef[jpeg_natural[k]] = dequant(f >> 8, q[k]);
+			}
+			continue;
+		}
+
+		s = bitsSymbol(b, ac);
+		if(s < 0){
+			return -1;
+		}
+		if((s & 15) == 0){
+			if(s != 0xf0){
+				break;
+			}
+			// sixteen zeros
+			k += 15;
+			continue;
+		}
+		k += s >> 4;
+		if(k > 63){
+			return -1;
+		}
+		int v = bitsValue(b, s & 15);
+		if(coef != NULL){
+			coef[jpeg_natural[k]] = dequant(v, q[k]);
+		}
+	}
+	return 0;
+}
+
+
+// One dimension of the integer IDCT, the Loeffler, Ligtenberg and Moschytz
+// factorisation with the constants scaled by 4096. The results are left
+// scaled by 4096 for the caller to round off.
+#define F12(x)	((int)((x) * 4096 + 0.5))
+
+static inline void idct8(const int * s, unsigned int step, int * even, int * odd)
+{
+	int p1, p2, p3, p4, p5, t0, t1, t2, t3;
+
+	p1 = (s[2 * step] + s[6 * step]) * F12(0.5411961);
+	t2 = p1 + s[6 * step] * F12(-1.847759065);
+	t3 = p1 + s[2 * step] * F12(0.765366865);
+	t0 = (s[0] + s[4 * step]) * 4096;
+	t1 = (s[0] - s[4 * step]) * 4096;
+	even[0] = t0 + t3;
+	even[3] = t0 - t3;
+	even[1] = t1 + t2;
+	even[2] = t1 - t2;
+
+	t0 = s[7 * step];
+	t1 = s[5 * step];
+	t2 = s[3 * step];
+	t3 = s[1 * step];
+	p3 = t0 + t2;
+	p4 = t1 + t3;
+	p1 = t0 + t3;
+	p2 = t1 + t2;
+	p5 = (p3 + p4) * F12(1.175875602);
+	t0 = t0 * F12(0.298631336);
+	t1 = t1 * F12(2.053119869);
+	t2 = t2 * F12(3.072711026);
+	t3 = t3 * F12(1.501321110);
+	p1 = p5 + p1 * F12(-0.899976223);
+	p2 = p5 + p2 * F12(-2.562915447);
+	p3 = p3 * F12(-1.961570560);
+	p4 = p4 * F12(-0.390180644);
+	odd[0] = t3 + p1 + p4;
+	odd[1] = t2 + p2 + p3;
+	odd[2] = t1 + p2 + p4;
+	odd[3] = t0 + p1 + p3;
+}
+
+
+// Transform a dequantised block into pixels. Columns go first, keeping two
+// more bits, and a column with nothing but its DC is filled in directly.
+static void idctBlock(const int * coef, unsigned char * out, unsigned int stride)
+{
+	int tmp[64];
+	int even[4], odd[4];
+
+	for(unsigned int x = 0; x < 8; x++){
+		const int * s = coef + x;
+
+		if(!(s[8] | s[16] | s[24] | s[32] | s[40] | s[48] | s[56])){
+			for(unsigned int y = 0; y < 8; y++){
+				tmp[y * 8 + x] = s[0] * 4;
+			}
+			continue;
+		}
+		idct8(s, 8, even, odd);
+		for(unsigned int i = 0; i < 4; i++){
+			tmp[i * 8 + x] = (even[i] + odd[i] + 512) >> 10;
+			tmp[(7 - i) * 8 + x] = (even[i] - odd[i] + 512) >> 10;
+		}
+	}
+
+	// rows take off the rest of the scaling and the level shift of 128
+	for(unsigned int y = 0; y < 8; y++, out += stride){
+		idct8(tmp + y * 8, 1, even, odd);
+		for(unsigned int i = 0; i < 4; i++){
+			out[i] = clamp8((even[i] + odd[i] + (1 << 16) + (128 << 17)) >> 17);
+			out[7 - i] = clamp8((even[i] - odd[i] + (1 << 16) + (128 << 17)) >> 17);
+		}
+	}
+}
+
+
+// Put a block into the image, cut down to the part inside it. With dc_only
+// the block is filled with its average, which is all its DC says.
+static void storeBlock(const int * coef, int dc_only, unsigned char * img_ptr, unsigned int stride,
+		       unsigned int width, unsigned int height, unsigned int x0, unsigned int y0)
+{
+	unsigned char block[64];
+	unsigned int w = width - x0 < 8 ? width - x0 : 8;
+	unsigned int h = height - y0 < 8 ? height - y0 : 8;
+
+	if(dc_only){
+		memset(block, clamp8(((coef[0] + 4) >> 3) + 128), sizeof(block));
+	} else {
+		idctBlock(coef, block, 8);
+	}
+	for(unsigned int y = 0; y < h; y++){
+		memcpy(img_ptr + (y0 + y) * stride + x0, block + y * 8, w);
+	}
+}
+
+
+// Read the segments up to the start of the first scan. Returns a pointer to
+// its entropy coded data, or NULL for anything this decoder cannot read.
+static const unsigned char * jpegHeaders(Jpeg * jpeg, const unsigned char * p, const unsigned char * end)
+{
+	if(end - p < 4 || p[0] != 0xff || p[1] != 0xd8){
+		return NULL;
+	}
+	p += 2;
+
+	while(end - p >= 4){
+		if(p[0] != 0xff){
+			return NULL;
+		}
+		if(p[1] == 0xff){
+			// fill byte
+			p++;
+			continue;
+		}
+
+		unsigned int marker = p[1];
+		unsigned int len = get16(p + 2);
+		const unsigned char * seg = p + 4;
+		const unsigned char * seg_end = p + 2 + len;
+
+		if(len < 2 || seg_end > end){
+			return NULL;
+		}
+		p = seg_end;
+
+		switch(marker){
+			case 0xdb:	// DQT
+				while(seg_end - seg >= 65){
+					unsigned int t = seg[0] & 3;
+					if(seg[0] >> 4){
+						// 16 bit tables are for 12 bit samples
+						return NULL;
+					}
+					for(unsigned int k = 0; k < 64; k++){
+						jpeg->quant[t][k] = seg[1 + k];
+					}
+					seg += 65;
+				}
+				break;
+
+			case 0xc4:	// DHT
+				while(seg_end - seg >= 17){
+					unsigned int n = 0;
+					for(unsigned int i = 0; i < 16; i++){
+						n += seg[1 + i];
+					}
+					if(n > 256 || seg_end - seg < 17 + (int)n){
+						return NULL;
+					}
+					JpegHuff * huff = (seg[0] >> 4) ? &jpeg->ac[seg[0] & 3] : &jpeg->dc[seg[0] & 3];
+					if(huffBuild(huff, seg + 1, seg + 17) != 0){
+						return NULL;
+					}
+					seg += 17 + n;
+				}
+				break;
+
+			case 0xdd:	// DRI
+				if(len < 4){
+					return NULL;
+				}
+				jpeg->restart = get16(seg);
+				break;
+
+			case 0xc0:	// SOF0, baseline
+			case 0xc1:	// SOF1, extended sequential Huffman
+				if(len < 8 || seg[0] != 8){
+					return NULL;
+				}
+				jpeg->height = get16(seg + 1);
+				jpeg->width = get16(seg + 3);
+				jpeg->n_comps = seg[5];
+				if(jpeg->n_comps == 0 || jpeg->n_comps > JPEG_COMPS || len < 8 + 3 * jpeg->n_comps){
+					return NULL;
+				}
+				for(unsigned int i = 0; i < jpeg->n_comps; i++){
+					JpegComp * c = &jpeg->comp[i];
+					c->id = seg[6 + i * 3];
+					c->h = seg[7 + i * 3] >> 4;
+					c->v = seg[7 + i * 3] & 15;
+					c->tq = seg[8 + i * 3] & 3;
+					if(c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4){
+						return NULL;
+					}
+					if(c->h > jpeg->h_max) jpeg->h_max = c->h;
+					if(c->v > jpeg->v_max) jpeg->v_max = c->v;
+				}
+				break;
+
+			case 0xda:	// SOS
+				if(jpeg->n_comps == 0 || len < 6 + 2 * seg[0]){
+					return NULL;
+				}
+				jpeg->scan_n = seg[0];
+				if(jpeg->scan_n == 0 || jpeg->scan_n > jpeg->n_comps){
+					return NULL;
+				}
+				for(unsigned int i = 0; i < jpeg->scan_n; i++){
+					JpegComp * c = NULL;
+					for(unsigned int j = 0; j < jpeg->n_comps; j++){
+						if(jpeg->comp[j].id == seg[1 + i * 2]){
+							c = &jpeg->comp[j];
+						}
+					}
+					if(c == NULL){
+						return NULL;
+					}
+					c->td = seg[2 + i * 2] >> 4 & 3;
+					c->ta = seg[2 + i * 2] & 3;
+					c->pred = 0;
+					jpeg->scan[i] = c;
+				}
+				return seg_end;
+
+			default:
+				// progressive, arithmetic, lossless and hierarchical
+				// frames are not for cameras
+				if(marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc){
+					return NULL;
+				}
+				// APPn, COM and the rest carry nothing needed here
+				break;
+		}
+	}
+	return NULL;
+}
+
+
+// whether a kept mask is the one for the frame and rectangles
+static int maskMatches(const JpegMask * m, const Jpeg * jpeg, const JpegComp * luma, unsigned int width,
+		       unsigned int height, const Rect * rects, unsigned int n_rects)
+{
+	return m->valid && m->mcus_x == jpeg->mcus_x && m->mcus_y == jpeg->mcus_y &&
+	       m->bh == luma->bh && m->bv == luma->bv && m->width == width && m->height == height &&
+	       m->n_rects == n_rects && memcmp(m->rects, rects, n_rects * sizeof(Rect)) == 0;
+}
+
+
+// Work out the blocks and MCUs the rectangles need, within width x height
+static int maskBuild(JpegMask * m, const Jpeg * jpeg, const JpegComp * luma, unsigned int width,
+		     unsigned int height, const Rect * rects, unsigned int n_rects)
+{
+	unsigned int blocks_x = jpeg->mcus_x * luma->bh;
+	unsigned int blocks = blocks_x * jpeg->mcus_y * luma->bv;
+	unsigned int n_mcus = jpeg->mcus_x * jpeg->mcus_y;
+	size_t size = n_rects * sizeof(Rect) + blocks + n_mcus;
+
+	// the memory only grows, frames like the last need none
+	m->valid = 0;
+	if(size > m->size){
+		unsigned char * mem = realloc(m->mem, size);
+		if(mem == NULL){
+			return -1;
+		}
+		m->mem = mem;
+		m->size = size;
+	}
+	m->rects = (Rect *)m->mem;
+	m->need = m->mem + n_rects * sizeof(Rect);
+	m->need_mcu = m->need + blocks;
+	memcpy(m->rects, rects, n_rects * sizeof(Rect));
+	memset(m->need, 0, blocks + n_mcus);
+	m->mcus_x = jpeg->mcus_x;
+	m->mcus_y = jpeg->mcus_y;
+	m->bh = luma->bh;
+	m->bv = luma->bv;
+	m->width = width;
+	m->height = height;
+	m->n_rects = n_rects;
+	m->last = -1;
+
+	for(unsigned int r = 0; r < n_rects; r++){
+		unsigned int x1 = rects[r].x + rects[r].w;
+		unsigned int y1 = rects[r].y + rects[r].h;
+
+		if(x1 > width) x1 = width;
+		if(y1 > height) y1 = height;
+		if(rects[r].x >= x1 || rects[r].y >= y1){
+			continue;
+		}
+		for(unsigned int by = rects[r].y / 8; by <= (y1 - 1) / 8; by++){
+			for(unsigned int bx = rects[r].x / 8; bx <= (x1 - 1) / 8; bx++){
+				unsigned int mcu = by / luma->bv * jpeg->mcus_x + bx / luma->bh;
+				m->need[by * blocks_x + bx] = 1;
+				m->need_mcu[mcu] = 1;
+				if((int)mcu > m->last) m->last = mcu;
+			}
+		}
+	}
+	m->valid = 1;
+	return 0;
+}
+
+
+// Take the mask for the frame and rectangles: the kept one if there is one,
+// otherwise the one unused longest is built again. It is the caller's until
+// maskPut. NULL if every mask is taken or there is no memory for it.
+static JpegMask * maskGet(const Jpeg * jpeg, const JpegComp * luma, unsigned int width,
+			  unsigned int height, const Rect * rects, unsigned int n_rects)
+{
+	JpegMask * m = NULL;
+
+	pthread_mutex_lock(&masks_lock);
+	for(unsigned int i = 0; i < JPEG_MASKS; i++){
+		if(masks[i].busy){
+			continue;
+		}
+		if(maskMatches(&masks[i], jpeg, luma, width, height, rects, n_rects)){
+			m = &masks[i];
+			break;
+		}
+		if(m == NULL || masks[i].used < m->used){
+			m = &masks[i];
+		}
+	}
+	if(m != NULL){
+		m->busy = 1;
+	}
+	pthread_mutex_unlock(&masks_lock);
+
+	if(m != NULL && !maskMatches(m, jpeg, luma, width, height, rects, n_rects) &&
+	   maskBuild(m, jpeg, luma, width, height, rects, n_rects) != 0){
+		maskPut(m);
+		return NULL;
+	}
+	return m;
+}
+
+
+// Decode the luma of an MJPEG frame into an image of width x height, one byte
+// a pixel, where the frame covers it. Only the 8x8 blocks touching the given
+// rectangles are decoded, the rest of the image is left untouched. With
+// dc_only the blocks are filled with their average instead of transformed,
+// for detection at resolutions where a block is finer than the needle.
+// Returns -1 if the frame is not a baseline JPEG or is corrupt, some of the
+// rectangles may have been written by then.
+int jpegToLuma(const unsigned char * data, unsigned int size, unsigned char * img_ptr,
+	       unsigned int width, unsigned int height, const Rect * rects, unsigned int n_rects, int dc_only)
+{
+	Jpeg jpeg;
+	JpegBits bits;
+	int coef[64];
+	const unsigned char * end = data + size;
+	const unsigned char * p;
+
+	memset(&jpeg, 0, sizeof(jpeg));
+	p = jpegHeaders(&jpeg, data, end);
+	if(p == NULL){
+		return -1;
+	}
+
+	// Luma is the first component. An interleaved scan has every component,
+	// a scan of the luma alone is how grey frames come.
+	JpegComp * luma = &jpeg.comp[0];
+	unsigned int luma_at = jpeg.scan_n;
+	for(unsigned int i = 0; i < jpeg.scan_n; i++){
+		if(jpeg.scan[i] == luma){
+			luma_at = i;
+		}
+	}
+	if(luma_at == jpeg.scan_n || (jpeg.scan_n > 1 && jpeg.scan_n != jpeg.n_comps) ||
+	   luma->h != jpeg.h_max || luma->v != jpeg.v_max){
+		return -1;
+	}
+	if(jpeg.scan_n == 1){
+		luma->bh = luma->bv = 1;
+		jpeg.mcus_x = (jpeg.width + 7) / 8;
+		jpeg.mcus_y = (jpeg.height + 7) / 8;
+	} else {
+		for(unsigned int i = 0; i < jpeg.scan_n; i++){
+			jpeg.scan[i]->bh = jpeg.scan[i]->h;
+			jpeg.scan[i]->bv = jpeg.scan[i]->v;
+		}
+		jpeg.mcus_x = (jpeg.width + 8 * jpeg.h_max - 1) / (8 * jpeg.h_max);
+		jpeg.mcus_y = (jpeg.height + 8 * jpeg.v_max - 1) / (8 * jpeg.v_max);
+	}
+
+	// frames without tables of their own use the standard ones
+	for(unsigned int i = 0; i < jpeg.scan_n; i++){
+		JpegComp * c = jpeg.scan[i];
+		if(!jpeg.dc[c->td].defined){
+			huffBuild(&jpeg.dc[c->td], jpeg_dc_bits[c->td != 0], jpeg_dc_values);
+		}
+		if(!jpeg.ac[c->ta].defined){
+			huffBuild(&jpeg.ac[c->ta], jpeg_ac_bits[c->ta != 0], jpeg_ac_values[c->ta != 0]);
+		}
+	}
+
+	// the part of the image the frame covers
+	unsigned int stride = width;
+	if(width > jpeg.width) width = jpeg.width;
+	if(height > jpeg.height) height = jpeg.height;
+
+	// which luma blocks are needed, and which MCUs have any
+	unsigned int blocks_x = jpeg.mcus_x * luma->bh;
+	unsigned int n_mcus = jpeg.mcus_x * jpeg.mcus_y;
+	JpegMask * mask = maskGet(&jpeg, luma, width, height, rects, n_rects);
+
+	if(mask == NULL){
+		return -1;
+	}
+	const unsigned char * need = mask->need;
+	const unsigned char * need_mcu = mask->need_mcu;
+	int last = mask->last;
+
+	int result = 0;
+	unsigned int ri = jpeg.restart;
+
+	bitsStart(&bits, p, end);
+	for(unsigned int mcu = 0; (int)mcu <= last; mcu++){
+		if(ri && mcu % ri == 0){
+			if(mcu > 0 && bitsRestart(&bits) != 0){
+				result = -1;
+				break;
+			}
+
+			// intervals without a block needed are passed over whole, the
+			// one with the last block needed stops it
+			while(!memchr(need_mcu + mcu, 1, n_mcus - mcu < ri ? n_mcus - mcu : ri)){
+				if(bitsRestart(&bits) != 0){
+					result = -1;
+					break;
+				}
+				mcu += ri;
+			}
+			if(result != 0){
+				break;
+			}
+			for(unsigned int c = 0; c < jpeg.scan_n; c++){
+				jpeg.scan[c]->pred = 0;
+			}
+		}
+
+		unsigned int mx = mcu % jpeg.mcus_x;
+		unsigned int my = mcu / jpeg.mcus_x;
+		for(unsigned int c = 0; c < jpeg.scan_n && result == 0; c++){
+			JpegComp * comp = jpeg.scan[c];
+
+			for(unsigned int v = 0; v < comp->bv && result == 0; v++){
+				for(unsigned int h = 0; h < comp->bh; h++){
+					unsigned int bx = mx * comp->bh + h;
+					unsigned int by = my * comp->bv + v;
+					int wanted = c == luma_at && need_mcu[mcu] && need[by * blocks_x + bx];
+
+					if(decodeBlock(&bits, &jpeg, comp, wanted ? coef : NULL) != 0){
+						result = -1;
+						break;
+					}
+					if(wanted){
+						storeBlock(coef, dc_only, img_ptr, stride, width, height, bx * 8, by * 8);
+					}
+				}
+			}
+		}
+		if(result != 0){
+			break;
+		}
+	}
+
+	maskPut(mask);
+	return result;
+}
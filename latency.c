@@ -0,0 +1,118 @@
+#include <stdio.h>
+
+#include <latency.h>
+
+// Fixed bucket counters per stage. A stage only has the one thread recording
+// it, so the counters are bumped with plain relaxed loads and stores rather
+// than locked read-modify-writes, and anyone can read them at any time for a
+// dump. Recording a stage costs the clock_gettime that ends it and a few adds.
+
+typedef struct {
+   unsigned long count[LAT_BUCKETS];
+   unsigned long long total_ns;
+   long long max_ns;
+} LatHist;
+
+static LatHist hist[LAT_STAGES];
+
+static const char *lat_names[LAT_STAGES] = {
+   "wait", "dqbuf", "gate", "convert", "regions", "angle", "update", "display", "publish", "frame"
+};
+
+#define LAT_BUMP(var, n)  __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+// Account a stage that started at start and ends now. Returns now, so the
+// next stage can start from it.
+long long latRecord(LatStage stage, long long start) {
+   LatHist *h = &hist[stage];
+   long long now = latNow();
+   long long ns = now - start;
+   int bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+
+   if (bucket >= LAT_BUCKETS) bucket = LAT_BUCKETS - 1;
+   LAT_BUMP(h->count[bucket], 1);
+   LAT_BUMP(h->total_ns, ns);
+   if (ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+   return now;
+}
+
+// upper bound in microseconds of the bucket holding the given fraction, the
+// largest value seen is the better bound in the top bucket
+static double latPercentile(const unsigned long *count, unsigned long n, double fraction, long long max_ns) {
+   unsigned long seen = 0;
+   int i;
+
+   for (i = 0; i < LAT_BUCKETS - 1; i++) {
+      seen += count[i];
+      if (seen >= fraction * n) break;
+   }
+   return (double)((1LL << i) < max_ns ? (1LL << i) : max_ns) / 1000.0;
+}
+
+// upper bound of bucket i for people, 512ns, 33us, 1.0ms, 2.1s
+static void latBound(char *buf, size_t size, int i) {
+   double ns = (double)(1ULL << i);
+
+   if (ns < 1e3) snprintf(buf, size, "%.0fns", ns);
+   else if (ns < 1e6) snprintf(buf, size, "%.0fus", ns / 1e3);
+   else if (ns < 1e9) snprintf(buf, size, "%.1fms", ns / 1e6);
+   else snprintf(buf, size, "%.1fs", ns / 1e9);
+}
+
+// Print every stage seen so far: percentiles, taken from the buckets so good
+// to a factor of 2, and the buckets themselves by their upper bound
+void latDump(FILE *fp) {
+   unsigned long count[LAT_BUCKETS];
+   unsigned long n;
+   long long max_ns;
+   char bound[16];
+   int s, i;
+
+   fprintf(fp, "%-10s %10s %10s %10s %10s %10s %10s\n", "stage (us)", "count", "mean", "p50", "p90", "p99", "max");
+   for (s = 0; s < LAT_STAGES; s++) {
+      n = 0;
+      for (i = 0; i < LAT_BUCKETS; i++) {
+         count[i] = __atomic_load_n(&hist[s].count[i], __ATOMIC_RELAXED);
+         n += count[i];
+      }
+      if (n == 0) continue;
+      max_ns = __atomic_load_n(&hist[s].max_ns, __ATOMIC_RELAXED);
+
+      fprintf(fp, "%-10s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", lat_names[s], n,
+              __atomic_load_n(&hist[s].total_ns, __ATOMIC_RELAXED) / 1000.0 / n,
+              latPercentile(count, n, 0.5, max_ns), latPercentile(count, n, 0.9, max_ns),
+              latPercentile(count, n, 0.99, max_ns), max_ns / 1000.0);
+
+      fprintf(fp, "          ");
+      for (i = 0; i < LAT_BUCKETS; i++) {
+         if (!count[i]) continue;
+         latBound(bound, sizeof(bound), i);
+         fprintf(fp, " <%s:%lu", bound, count[i]);
+      }
+      fprintf(fp, "\n");
+   }
+   fflush(fp);
+}
+
+// Every stage as a Prometheus histogram in seconds, the buckets cumulative as
+// Prometheus has them. The counts are read one at a time while the stages go
+// on being recorded, so the total is the sum of the buckets as read.
+void latExport(FILE *fp, const char *name) {
+   unsigned long seen;
+   int s, i;
+
+   fprintf(fp, "# HELP %s Time taken by each stage of the frame pipeline.\n", name);
+   fprintf(fp, "# TYPE %s histogram\n", name);
+   for (s = 0; s < LAT_STAGES; s++) {
+      seen = 0;
+      for (i = 0; i < LAT_BUCKETS - 1; i++) {
+         seen += __atomic_load_n(&hist[s].count[i], __ATOMIC_RELAXED);
+         fprintf(fp, "%s_bucket{stage=\"%s\",le=\"%.9g\"} %lu\n", name, lat_names[s], (double)(1ULL << i) / 1e9, seen);
+      }
+      seen += __atomic_load_n(&hist[s].count[i], __ATOMIC_RELAXED);
+      fprintf(fp, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", name, lat_names[s], seen);
+      fprintf(fp, "%s_sum{stage=\"%s\"} %.9f\n", name, lat_names[s],
+              __atomic_load_n(&hist[s].total_ns, __ATOMIC_RELAXED) / 1e9);
+      fprintf(fp, "%s_count{stage=\"%s\"} %lu\n", name, lat_names[s], seen);
+   }
+}
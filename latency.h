@@ -0,0 +1,37 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdio.h>
+#include <time.h>
+
+// log2 buckets of nanoseconds, the last one takes everything from 2^38 ns
+// (about 4.6 minutes) up
+#define LAT_BUCKETS  40
+
+// stages timed on every frame. Each is only ever recorded by one thread.
+typedef enum {
+   LAT_WAIT,                  // capture thread blocked in epoll_wait
+   LAT_DQBUF,                 // taking a frame off the camera
+   LAT_GATE,                  // motion gate
+   LAT_CONVERT,               // YUYV to RGB of what the analysis needs
+   LAT_REGIONS,               // scoring the regions
+   LAT_ANGLE,                 // needle angle
+   LAT_UPDATE,                // updateValues
+   LAT_DISPLAY,               // drawing and showing a frame
+   LAT_PUBLISH,               // queueing values for the broker
+   LAT_FRAME,                 // a frame from capture to analysed
+   LAT_STAGES
+} LatStage;
+
+// monotonic nanoseconds, what stages are timed with
+static inline long long latNow(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long latRecord(LatStage stage, long long start);
+void latDump(FILE *fp);
+void latExport(FILE *fp, const char *name);
+
+#endif // _LATENCY_H_
@@ -0,0 +1,667 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "meter.h"
+
+// Create a meter for a dial centred at org_x, org_y with the given radius,
+// with n regions round it. The accumulated values start from zero.
+Meter *meterNew(const char *name, unsigned int org_x, unsigned int org_y, unsigned int org_r,
+                unsigned int regions) {
+
+   Meter *m = calloc(1, sizeof(*m));
+   if (!m) return NULL;
+
+   m->name = name;
+   m->org_x = org_x;
+   m->org_y = org_y;
+   m->org_r = org_r;
+   m->last_angle = -1.0;
+   m->last_region_number = -1;
+
+   // bounding box of the dial, what the needle angle estimator needs decoded
+   m->dial_box.x = org_x - org_r;
+   m->dial_box.y = org_y - org_r;
+   m->dial_box.w = 2*org_r + RGN_WIDTH;
+   m->dial_box.h = 2*org_r + RGN_HEIGHT;
+
+   regionsInit(m, regions);
+   return m;
+}
+
+void meterFree(Meter *m) {
+
+   free(m->pix_offset);
+   free(m->dark_sat);
+   free(m);
+}
+
+// Set up n regions round the dial. 8 keeps the hand placed layout, any other
+// count is spread evenly from region 0 in the same direction.
+void regionsInit(Meter *m, unsigned int n) {
+
+   unsigned int i;
+   unsigned int x0 = ~0u, y0 = ~0u, x1 = 0, y1 = 0;
+   unsigned int ox = m->org_x, oy = m->org_y, r = m->org_r;
+   unsigned int d = (unsigned int)(r*0.71);
+
+   if (n > MAX_REGIONS) n = MAX_REGIONS;
+   if (n < 2) n = 2;
+
+   const unsigned int xDiv[5] = { ox-r, ox-d, ox, ox+d, ox+r };
+   const unsigned int yDiv[5] = { oy-r, oy-d, oy, oy+d, oy+r };
+   memcpy(m->xDiv, xDiv, sizeof(xDiv));
+   memcpy(m->yDiv, yDiv, sizeof(yDiv));
+
+   if (n == NUM_REGIONS) {
+      const REGION table[NUM_REGIONS] = {
+         {xDiv[1], yDiv[3], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[0], yDiv[2], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[1], yDiv[1], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[2], yDiv[0], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[3], yDiv[1], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[4], yDiv[2], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[3], yDiv[3], RGN_WIDTH, RGN_HEIGHT},
+         {xDiv[2], yDiv[4], RGN_WIDTH, RGN_HEIGHT}
+      };
+      memcpy(m->region, table, sizeof(table));
+   } else {
+      for (i = 0; i < n; i++) {
+         // region 0 sits at 135 degrees on screen, y pointing down
+         double a = (135.0 + i * 360.0 / n) * M_PI / 180.0;
+         m->region[i].x = (unsigned int)lround(ox + r * cos(a));
+         m->region[i].y = (unsigned int)lround(oy + r * sin(a));
+         m->region[i].w = RGN_WIDTH;
+         m->region[i].h = RGN_HEIGHT;
+      }
+   }
+   m->num_regions = n;
+
+   for (i = 0; i < m->num_regions; i++) {
+      if (m->region[i].x < x0) x0 = m->region[i].x;
+      if (m->region[i].y < y0) y0 = m->region[i].y;
+      if (m->region[i].x + m->region[i].w > x1) x1 = m->region[i].x + m->region[i].w;
+      if (m->region[i].y + m->region[i].h > y1) y1 = m->region[i].y + m->region[i].h;
+   }
+   m->region_box.x = x0;
+   m->region_box.y = y0;
+   m->region_box.w = x1 - x0;
+   m->region_box.h = y1 - y0;
+
+   // building the table costs about twice as much per pixel as counting one
+   // region directly, so it only pays off when the regions add up to more
+   unsigned int area = 0;
+   for (i = 0; i < m->num_regions; i++) area += m->region[i].w * m->region[i].h;
+   m->use_sat = area > SAT_FACTOR * m->region_box.w * m->region_box.h;
+
+   // offset tables follow on the next frame
+   m->table_width = 0;
+}
+
+// The rectangles that have to be decoded for regionHit, the regions themselves
+// or, when they overlap enough to use the table, their bounding box
+const Rect *regionDecodeRects(Meter *m, unsigned int *n) {
+
+   if (m->use_sat) {
+      *n = 1;
+      return &m->region_box;
+   }
+   *n = m->num_regions;
+   return m->region;
+}
+
+// Build the dark pixel table over the region box in one row-major pass. Pixels
+// outside the regions cancel out of every region sum, so they need not be decoded.
+// A luma pixel is dark below 128, a colour one if any channel is.
+static void buildDarkSat(Meter *m, Image *img) {
+
+   unsigned int x, y;
+   unsigned int w = m->region_box.w;
+   unsigned int h = m->region_box.h;
+
+   if (m->region_box.x + w > img->width) w = img->width - m->region_box.x;
+   if (m->region_box.y + h > img->height) h = img->height - m->region_box.y;
+
+   if ((w + 1) * (h + 1) > m->dark_sat_size) {
+      free(m->dark_sat);
+      m->dark_sat_size = (w + 1) * (h + 1);
+      m->dark_sat = calloc(m->dark_sat_size, sizeof(*m->dark_sat));
+   }
+   m->sat_w = w;
+   m->sat_h = h;
+
+   unsigned int stride = w + 1;
+   for (x = 0; x <= w; x++) m->dark_sat[x] = 0;
+
+   for (y = 0; y < h; y++) {
+      const unsigned char *pixel = (const unsigned char *)imgGetPixel(img, m->region_box.x, m->region_box.y + y);
+      unsigned int *above = m->dark_sat + y * stride;
+      unsigned int *row = above + stride;
+      unsigned int run = 0;
+
+      row[0] = 0;
+      if (img->format == IMG_LUMA) {
+         for (x = 0; x < w; x++) {
+            run += (pixel[x] >> 7) ^ 1;
+            row[x + 1] = above[x + 1] + run;
+         }
+         continue;
+      }
+      for (x = 0; x < w; x++, pixel += 3) {
+         // dark if any channel is below 128, i.e. not all top bits set
+         run += ((pixel[0] & pixel[1] & pixel[2]) >> 7) ^ 1;
+         row[x + 1] = above[x + 1] + run;
+      }
+   }
+}
+
+// Structure-of-arrays offset tables, rebuilt when the regions or the image
+// width or format change. pix_offset holds pixel j of every region side by side, so the
+// inner loop runs across regions. Regions smaller than the largest repeat
+// their first pixel, pix_pad says how many times.
+static void regionTables(Meter *m, unsigned int width, unsigned int height, unsigned int bpp) {
+
+   unsigned int i, j;
+   unsigned int w = m->region_box.w;
+   unsigned int h = m->region_box.h;
+
+   if (m->region_box.x + w > width) w = width - m->region_box.x;
+   if (m->region_box.y + h > height) h = height - m->region_box.y;
+
+   m->pix_count = 0;
+   for (i = 0; i < m->num_regions; i++) {
+      if (m->region[i].w * m->region[i].h > m->pix_count) m->pix_count = m->region[i].w * m->region[i].h;
+   }
+   free(m->pix_offset);
+   m->pix_offset = malloc(m->pix_count * m->num_regions * sizeof(*m->pix_offset));
+
+   for (i = 0; i < m->num_regions; i++) {
+      unsigned int area = m->region[i].w * m->region[i].h;
+
+      for (j = 0; j < m->pix_count; j++) {
+         unsigned int k = j < area ? j : 0;
+         unsigned int x = m->region[i].x + k % m->region[i].w;
+         unsigned int y = m->region[i].y + k / m->region[i].w;
+         m->pix_offset[j * m->num_regions + i] = (x + y * width) * bpp;
+      }
+      m->pix_pad[i] = m->pix_count - area;
+      m->inv_area[i] = 1.0f / area;
+
+      // corners of the region in the dark pixel table
+      unsigned int stride = w + 1;
+      unsigned int x0 = m->region[i].x - m->region_box.x;
+      unsigned int y0 = m->region[i].y - m->region_box.y;
+      unsigned int x1 = x0 + m->region[i].w;
+      unsigned int y1 = y0 + m->region[i].h;
+      if (x1 > w) x1 = w;
+      if (y1 > h) y1 = h;
+      m->sat_a[i] = y1 * stride + x1;
+      m->sat_b[i] = y0 * stride + x1;
+      m->sat_c[i] = y1 * stride + x0;
+      m->sat_d[i] = y0 * stride + x0;
+   }
+   m->table_width = width;
+   m->table_bpp = bpp;
+}
+
+// Dark pixels of every region, in one pass over the offset table or with four
+// lookups per region in the dark pixel table
+static void regionCounts(Meter *m, Image *img, unsigned int *counts, int sat) {
+
+   unsigned int i, j;
+   const unsigned char *data = (const unsigned char *)img->data;
+
+   if (m->table_width != img->width || m->table_bpp != img->bpp) regionTables(m, img->width, img->height, img->bpp);
+
+   if (sat) {
+      buildDarkSat(m, img);
+      for (i = 0; i < m->num_regions; i++) {
+         counts[i] = m->dark_sat[m->sat_a[i]] - m->dark_sat[m->sat_b[i]] - m->dark_sat[m->sat_c[i]] + m->dark_sat[m->sat_d[i]];
+      }
+      return;
+   }
+
+   for (i = 0; i < m->num_regions; i++) counts[i] = 0;
+   if (img->format == IMG_LUMA) {
+      for (j = 0; j < m->pix_count; j++) {
+         const unsigned int *offset = &m->pix_offset[j * m->num_regions];
+         for (i = 0; i < m->num_regions; i++) counts[i] += (data[offset[i]] >> 7) ^ 1;
+      }
+      for (i = 0; i < m->num_regions; i++) counts[i] -= m->pix_pad[i] * ((data[m->pix_offset[i]] >> 7) ^ 1);
+      return;
+   }
+   for (j = 0; j < m->pix_count; j++) {
+      const unsigned int *offset = &m->pix_offset[j * m->num_regions];
+      for (i = 0; i < m->num_regions; i++) {
+         const unsigned char *pixel = data + offset[i];
+         // dark if any channel is below 128, i.e. not all top bits set
+         counts[i] += ((pixel[0] & pixel[1] & pixel[2]) >> 7) ^ 1;
+      }
+   }
+   for (i = 0; i < m->num_regions; i++) {
+      if (m->pix_pad[i]) {
+         const unsigned char *pixel = data + m->pix_offset[i];
+         counts[i] -= m->pix_pad[i] * (((pixel[0] & pixel[1] & pixel[2]) >> 7) ^ 1);
+      }
+   }
+}
+
+// Dark pixels in region i counted pixel by pixel, the reference for regionCounts
+unsigned int regionCountLoop(Meter *m, Image *img, unsigned int i) {
+
+   unsigned int x, y;
+   unsigned int rx, ry, rw, rh;
+   unsigned int count_dark = 0;
+   unsigned char red;
+   unsigned char green;
+   unsigned char blue;
+   unsigned char *pixel;
+
+   rx = m->region[i].x;
+   ry = m->region[i].y;
+   rw = m->region[i].w;
+   rh = m->region[i].h;
+
+   // Count number of dark pixels in given region
+   for (x = rx; x < rx + rw; x++) {
+      for (y = ry; y < ry + rh; y++) {
+         // Get a pointer to the current pixel
+         pixel = (unsigned char *)imgGetPixel(img, x, y);
+
+         // index 0 is blue, 1 is green and 2 is red, a luma image has just the one
+         red = pixel[2 % img->bpp];
+         green = pixel[1 % img->bpp];
+         blue = pixel[0];
+
+         // check if pixel is dark
+         if (red < 128 || green < 128 || blue < 128){
+            count_dark++;
+         }
+      }
+   }
+
+   return count_dark;
+}
+
+// Number of regions where either counting path differs from regionCountLoop
+int regionCheck(Meter *m, Image *img) {
+
+   unsigned int i;
+   unsigned int counts[MAX_REGIONS];
+   unsigned int sat_counts[MAX_REGIONS];
+   int mismatches = 0;
+
+   regionCounts(m, img, counts, 0);
+   regionCounts(m, img, sat_counts, 1);
+   for (i = 0; i < m->num_regions; i++) {
+      unsigned int expected = regionCountLoop(m, img, i);
+      if (counts[i] != expected || sat_counts[i] != expected) mismatches++;
+   }
+   return mismatches;
+}
+
+// Score every region: the dark fraction of each, the mask of regions above
+// the hit threshold and the strongest of those
+void regionScores(Meter *m, Image *img, RegionScores *scores) {
+
+   unsigned int i;
+   unsigned int counts[MAX_REGIONS];
+   uint64_t hits = 0;
+   int best = -1;
+
+   regionCounts(m, img, counts, m->use_sat);
+
+   for (i = 0; i < m->num_regions; i++) {
+      scores->dark[i] = counts[i] * m->inv_area[i];
+   }
+   for (i = 0; i < m->num_regions; i++) {
+      // We have a hit if more than 80% of the pixels is dark
+      hits |= (uint64_t)(counts[i] * 5 > m->region[i].w * m->region[i].h * 4) << i;
+   }
+   for (i = 0; i < m->num_regions; i++) {
+      if ((hits >> i & 1) && (best < 0 || scores->dark[i] > scores->dark[best])) best = i;
+   }
+   scores->hits = hits;
+   scores->best = best;
+}
+
+// The strongest region with a hit, or -1
+int regionHit(Meter *m, Image *img) {
+
+   RegionScores scores;
+
+   regionScores(m, img, &scores);
+   return scores.best;
+}
+
+// Set up a motion gate over the given rectangles of a frame. Returns -1 out
+// of memory.
+int gateInit(MotionGate *g, const Rect *rects, unsigned int n_rects) {
+
+   unsigned int i;
+
+   memset(g, 0, sizeof(*g));
+   g->rects = malloc(n_rects * sizeof(*rects));
+   if (!g->rects) return -1;
+   memcpy(g->rects, rects, n_rects * sizeof(*rects));
+   g->n_rects = n_rects;
+
+   for (i = 0; i < n_rects; i++) {
+      g->n += ((rects[i].w + GATE_STEP - 1) / GATE_STEP) * ((rects[i].h + GATE_STEP - 1) / GATE_STEP);
+   }
+   g->last = malloc(g->n);
+   g->cur = malloc(g->n);
+   if (!g->last || !g->cur) {
+      gateFree(g);
+      return -1;
+   }
+   return 0;
+}
+
+void gateFree(MotionGate *g) {
+
+   free(g->rects);
+   free(g->last);
+   free(g->cur);
+   g->rects = NULL;
+   g->last = g->cur = NULL;
+}
+
+// Whether a frame captured at stamp has changed enough since the last one let
+// through to be worth analysing. Reads the luma of a YUYV frame, or the
+// sensor samples of a Bayer one, straight out of the frame, so unchanged
+// frames are never converted. Pixels the analysis does not look at cannot
+// change its result, so they are not looked at either. Compressed frames
+// cannot be read without decoding them, they all pass.
+int gatePass(MotionGate *g, const Frame *frame, double stamp) {
+
+   unsigned int r, x, y, i = 0;
+   unsigned int step = frmPixelStep(frame);
+   unsigned int sad = 0;
+   unsigned char *swap;
+
+   if (!step) {
+      __atomic_store_n(&g->passed, g->passed + 1, __ATOMIC_RELAXED);
+      return 1;
+   }
+
+   for (r = 0; r < g->n_rects; r++) {
+      const Rect *rect = &g->rects[r];
+
+      for (y = rect->y; y < rect->y + rect->h; y += GATE_STEP) {
+         const unsigned char *row = frame->data + y * frame->stride + rect->x * step;
+
+         for (x = 0; x < rect->w; x += GATE_STEP, i++) {
+            int d = abs(row[x * step] - g->last[i]) - GATE_NOISE;
+
+            g->cur[i] = row[x * step];
+            sad += d > 0 ? d : 0;
+         }
+      }
+   }
+
+   if (g->primed && sad <= GATE_THRESHOLD && stamp - g->last_stamp < GATE_MAX_GAP) {
+      __atomic_store_n(&g->gated, g->gated + 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   // this frame is what the next ones are compared with
+   swap = g->last;
+   g->last = g->cur;
+   g->cur = swap;
+   g->primed = 1;
+   g->last_stamp = stamp;
+   __atomic_store_n(&g->passed, g->passed + 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+void drawRegion(Image *img, REGION region, unsigned char red, unsigned char green, unsigned char blue) {
+
+   unsigned int x, y;
+   unsigned int rx, ry, rw, rh;
+
+   rx = region.x;
+   ry = region.y;
+   rw = region.w;
+   rh = region.h;
+
+   y = ry;
+   for (x = rx; x < rx + rw; x++) imgSetPixel(img, x, y, blue, green, red);
+   y = ry + rh;
+   for (x = rx; x < rx + rw; x++) imgSetPixel(img, x, y, blue, green, red);
+   x = rx;
+   for (y = ry; y < ry + rh; y++) imgSetPixel(img, x, y, blue, green, red);
+   x = rx + rw;
+   for (y = ry; y < ry + rh; y++) imgSetPixel(img, x, y, blue, green, red);
+}
+
+// Precompute the sample offsets for images of the given width. Rays start at
+// region 0 and go round in region order, samples run from the hub outwards.
+static void angleInit(Meter *m, unsigned int width, unsigned int bpp) {
+
+   unsigned int i, k;
+   double cx = m->org_x + RGN_WIDTH / 2.0;
+   double cy = m->org_y + RGN_HEIGHT / 2.0;
+   double r_min = ANGLE_R_MIN(m->org_r);
+
+   for (i = 0; i < ANGLE_RAYS; i++) {
+      // region 0 sits at 135 degrees on screen, y pointing down
+      double a = (135.0 + i * 360.0 / ANGLE_RAYS) * M_PI / 180.0;
+      for (k = 0; k < ANGLE_SAMPLES; k++) {
+         double r = r_min + k * (m->org_r - r_min) / (ANGLE_SAMPLES - 1);
+         unsigned int x = (unsigned int)lround(cx + r * cos(a));
+         unsigned int y = (unsigned int)lround(cy + r * sin(a));
+         m->angle_offset[i * ANGLE_SAMPLES + k] = (x + y * width) * bpp;
+      }
+   }
+   m->angle_width = width;
+   m->angle_bpp = bpp;
+}
+
+// Estimate the needle angle in degrees, 0 at region 0 and increasing in region
+// order, or -1 when no ray is dark enough. Only the dial box has to be decoded.
+double needleAngle(Meter *m, Image *img) {
+
+   unsigned int i, k;
+   unsigned int score[ANGLE_RAYS];
+   unsigned int dark[ANGLE_RAYS];
+   unsigned int best = 0;
+   unsigned int floor_score = ~0u;
+   const unsigned char *data = (const unsigned char *)img->data;
+
+   if (m->angle_width != img->width || m->angle_bpp != img->bpp) angleInit(m, img->width, img->bpp);
+
+   for (i = 0; i < ANGLE_RAYS; i++) {
+      const unsigned int *offset = &m->angle_offset[i * ANGLE_SAMPLES];
+      unsigned int sum = 0;
+
+      dark[i] = 0;
+      for (k = 0; k < ANGLE_SAMPLES; k++) {
+         const unsigned char *pixel = data + offset[k];
+         unsigned char lo = pixel[0];
+         if (img->bpp == 3) {
+            if (pixel[1] < lo) lo = pixel[1];
+            if (pixel[2] < lo) lo = pixel[2];
+         }
+         // same rule as regionHit, a pixel is dark if its luma or any channel is below 128
+         dark[i] += lo < 128;
+         sum += 255 - lo;
+      }
+      score[i] = sum;
+      if (sum > score[best]) best = i;
+      if (sum < floor_score) floor_score = sum;
+   }
+
+   // most of the darkest ray has to be needle
+   if (dark[best] < ANGLE_SAMPLES * 0.8) return -1.0;
+
+   // centroid of the needle's rays above the background, the needle covers
+   // several rays so this resolves well below the ray spacing
+   double weight = 0.0;
+   double moment = 0.0;
+   for (int d = -ANGLE_WINDOW; d <= ANGLE_WINDOW; d++) {
+      double w = score[(best + ANGLE_RAYS + d) % ANGLE_RAYS] - (double)floor_score;
+      weight += w;
+      moment += w * d;
+   }
+
+   double angle = (best + moment / weight) * 360.0 / ANGLE_RAYS;
+   if (angle < 0.0) angle += 360.0;
+   if (angle >= 360.0) angle -= 360.0;
+   return angle;
+}
+
+// Litres the needle has moved since the last committed angle. Movement inside
+// the deadband is treated as noise, a large step back resynchronises.
+static double angleLitres(Meter *m, double angle) {
+
+   double delta;
+
+   if (m->last_angle < 0.0) {
+      m->last_angle = angle;
+      return 0.0;
+   }
+
+   delta = angle - m->last_angle;
+   if (delta > 180.0) delta -= 360.0;
+   if (delta <= -180.0) delta += 360.0;
+
+   if (delta > ANGLE_DEADBAND) {
+      m->last_angle = angle;
+      return delta / 360.0;
+   }
+   if (delta < -ANGLE_RESYNC) m->last_angle = angle;
+   return 0.0;
+}
+
+// The region with the strongest evidence. When the needle sits between two
+// regions and they are equally dark, the one fewest steps ahead of the last
+// region wins, so the result no longer depends on the region order.
+static int pickRegion(Meter *m, const RegionScores *scores, int last_region_number) {
+
+   unsigned int i;
+   int best = -1;
+   unsigned int best_steps = 0;
+
+   for (i = 0; i < m->num_regions; i++) {
+      if (!(scores->hits >> i & 1)) continue;
+
+      unsigned int steps = last_region_number < 0 ? i : (i + m->num_regions - last_region_number) % m->num_regions;
+      if (best < 0 || scores->dark[i] > scores->dark[best] ||
+          (scores->dark[i] == scores->dark[best] && steps < best_steps)) {
+         best = i;
+         best_steps = steps;
+      }
+   }
+   return best;
+}
+
+// Log line prefix, the wall clock time and the meter's name if it has one
+static void meterTag(Meter *m, time_t t, char *tag, size_t size) {
+
+   struct tm tm;
+   char time_str[20];
+
+   localtime_r(&t, &tm);
+   strftime(time_str, sizeof(time_str), "%H:%M:%S", &tm);
+   snprintf(tag, size, "%s%s%s", time_str, *m->name ? " " : "", m->name);
+}
+
+// Account for one frame and return the region it counted as hit, or -1. With
+// angle >= 0 the flow comes from the needle angle, otherwise from the regions
+// passed since the last hit, or from the hit region's angle once the needle
+// angle has been seen. sequence and stamp (seconds) are the camera's
+// frame number and capture time: gaps in the sequence are frames that never
+// reached the meter, and the capture times of the transitions give the flow.
+// Runs on every frame, so it leaves the clock alone unless there is a hit to log.
+int updateValues(Meter *m, const RegionScores *scores, double angle, unsigned int sequence, double stamp) {
+
+   int    elapsed_regions;
+   int    new_region_number = pickRegion(m, scores, m->last_region_number);
+   double litres = 0.0;
+   char   tag[64];
+
+   // a sequence going backwards is the camera being restarted, not frames lost
+   if (m->have_sequence && sequence > m->last_sequence + 1) {
+      m->dropped += sequence - m->last_sequence - 1;
+      __atomic_store_n(&m->dropped_total, m->dropped_total + sequence - m->last_sequence - 1, __ATOMIC_RELAXED);
+   }
+   if (!m->have_sequence) m->moved_stamp = stamp;
+   m->last_sequence = sequence;
+   m->have_sequence = 1;
+
+   if (new_region_number != -1 && m->last_region_number != -1 &&
+       new_region_number != m->last_region_number) {
+      elapsed_regions = new_region_number - m->last_region_number;
+      if (elapsed_regions < 0) elapsed_regions += m->num_regions;
+
+      if (m->last_hit_stamp > 0.0 && stamp > m->last_hit_stamp) {
+         m->flow = elapsed_regions * 60.0 / m->num_regions / (stamp - m->last_hit_stamp);
+      }
+      m->last_hit_stamp = stamp;
+      m->moved_stamp = stamp;
+      __atomic_store_n(&m->region_hits[new_region_number], m->region_hits[new_region_number] + 1, __ATOMIC_RELAXED);
+
+      meterTag(m, time(0), tag, sizeof(tag));
+      fprintf(stdout, "%s - Hit region: %d [ +%.3g l, %.2f l/min ]\n", tag, new_region_number,
+              1.0 / m->num_regions, m->flow);
+      fflush(stdout);
+
+      // a hit while the angle is lost moves the angle on to the region's,
+      // so the movement is not counted again once the angle is back
+      if (angle < 0.0 && m->last_angle >= 0.0) {
+         litres = angleLitres(m, new_region_number * 360.0 / m->num_regions);
+      } else if (angle < 0.0) {
+         litres = elapsed_regions * 1.0 / m->num_regions;
+      }
+   }
+   if (angle >= 0.0) litres = angleLitres(m, angle);
+
+   m->total         += litres;
+   m->last_minute   += litres;
+   m->last_10minute += litres;
+   m->last_drain    += litres;
+
+   if (new_region_number != -1) m->last_region_number = new_region_number;
+   m->frame_rate++;
+   m->idle = stamp - m->moved_stamp >= METER_IDLE_DELAY;
+
+   return new_region_number;
+}
+
+// Frames the capture left out on purpose while the meter was idle, so they are
+// not counted as dropped
+void meterSkipped(Meter *m, unsigned int n) {
+   m->last_sequence += n;
+}
+
+// Close the minute ending at now: publish the values and start a new minute,
+// and a new 10 minutes on the wall clock's 10 minute marks. Driven by a timer
+// aligned to the minute rather than checked on every frame.
+void meterRollup(Meter *m, time_t now) {
+
+   struct tm tm;
+   char tag[64];
+
+   localtime_r(&now, &tm);
+   meterTag(m, now, tag, sizeof(tag));
+
+   publishValues(m, now, m->last_minute, m->last_10minute, m->last_drain, m->total);
+
+   fprintf(stdout, "%s - Last minute: %6.2f l, Last 10min: %6.2f l, Last drain: %6.2f l, Total: %8.2f l, Framerate: %d, Dropped: %d\n",
+           tag, m->last_minute, m->last_10minute, m->last_drain, m->total + m->start_value, m->frame_rate/60, m->dropped);
+   fflush(stdout);
+
+   // no transition all minute, the flow has stopped
+   if (m->last_minute == 0.0) {
+      m->last_drain = 0.0;
+      m->flow = 0.0;
+   }
+   m->last_minute = 0.0;
+   m->frame_rate = 0;
+   m->dropped = 0;
+
+   if (tm.tm_min % 10 == 0) m->last_10minute = 0.0;
+}
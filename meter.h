@@ -0,0 +1,152 @@
+#ifndef _METER_H_
+#define _METER_H_
+
+#include <time.h>
+#include <stdint.h>
+
+#include <imgproc.h>
+
+#define NUM_REGIONS      8
+#define MAX_REGIONS     64
+// use the dark pixel table once the regions cover this many times their bounding box
+#define SAT_FACTOR       1
+#define IMAGE_WIDTH    176
+#define IMAGE_HEIGHT   144
+#define RGN_WIDTH       10
+#define RGN_HEIGHT      10
+
+typedef Rect REGION;
+
+// default dial geometry, each meter can have its own origin and radius
+#define ORG_X 67
+#define ORG_Y 45
+#define ORG_R 30
+
+// needle angle estimator: rays round the dial, samples per ray, innermost
+// sample radius, rays either side of the darkest one in the centroid, and the
+// movement in degrees ignored as noise or taken as a misread that resynchronises
+#define ANGLE_RAYS     180
+#define ANGLE_SAMPLES    5
+#define ANGLE_R_MIN(r)  ((r)*2/5)
+#define ANGLE_WINDOW    12
+#define ANGLE_DEADBAND 1.5
+#define ANGLE_RESYNC  20.0
+
+// adaptive capture rate: a meter goes idle once the needle has stayed in its
+// region for METER_IDLE_DELAY seconds. Idle, the needle still has to be seen
+// at least every half revolution (half a litre) at the meter's highest flow
+// in l/min, with a safety factor of 2 for the time it takes to speed up again.
+// It never drops below a frame a second, a rate of 0 would stop the counting.
+#define METER_IDLE_DELAY   10
+#define METER_MAX_FLOW     40
+#define METER_IDLE_FPS(max_flow)  ((max_flow) > 15 ? ((max_flow) + 14) / 15 : 1)
+
+// motion gate: the luma of every GATE_STEP'th pixel of every GATE_STEP'th row
+// of the rectangles the analysis decodes is compared with the last frame let
+// through. Differences up to
+// GATE_NOISE are sensor noise, the rest add up to a SAD that has to pass
+// GATE_THRESHOLD. A frame is let through every GATE_MAX_GAP seconds anyway so
+// the meter still sees time pass.
+#define GATE_STEP          2
+#define GATE_NOISE        12
+#define GATE_THRESHOLD   256
+#define GATE_MAX_GAP       1
+
+typedef struct {
+   Rect *rects;
+   unsigned int n_rects;
+   unsigned int n;            // samples per frame
+   unsigned char *last;       // samples of the last frame let through
+   unsigned char *cur;
+   int primed;
+   double last_stamp;
+   unsigned long gated;       // counters, stored atomically for the metrics
+   unsigned long passed;
+} MotionGate;
+
+// every region scored for one frame
+typedef struct {
+   float dark[MAX_REGIONS];   // fraction of dark pixels
+   uint64_t hits;             // regions more than 80% dark
+   int best;                  // darkest region with a hit, or -1
+} RegionScores;
+
+// one dial watched by one camera: its geometry, detection tables and
+// accumulated values. Meters share nothing, so one process can serve several.
+typedef struct {
+   const char *name;          // "" for the default meter
+   unsigned int org_x;
+   unsigned int org_y;
+   unsigned int org_r;
+   unsigned int xDiv[5];
+   unsigned int yDiv[5];
+   REGION region[MAX_REGIONS];
+   unsigned int num_regions;
+   Rect region_box;           // bounding box of all regions
+   Rect dial_box;             // what the needle angle estimator needs decoded
+   double start_value;
+
+   // region tables, rebuilt when the regions or the image width or format change
+   unsigned int table_width;
+   unsigned int table_bpp;
+   int use_sat;
+   unsigned int *pix_offset;
+   unsigned int pix_count;
+   unsigned int pix_pad[MAX_REGIONS];
+   unsigned int sat_a[MAX_REGIONS], sat_b[MAX_REGIONS], sat_c[MAX_REGIONS], sat_d[MAX_REGIONS];
+   float inv_area[MAX_REGIONS];
+   unsigned int *dark_sat;
+   unsigned int dark_sat_size;
+   unsigned int sat_w;
+   unsigned int sat_h;
+
+   // polar sample offsets of the needle angle estimator
+   unsigned int angle_offset[ANGLE_RAYS * ANGLE_SAMPLES];
+   unsigned int angle_width;
+   unsigned int angle_bpp;
+   double last_angle;
+
+   // accumulated values, the minute and 10 minute windows are closed by meterRollup
+   int last_region_number;
+   int frame_rate;
+   int dropped;               // frames missing from the sequence this minute
+   unsigned long dropped_total; // and since the start, stored atomically for the metrics
+   unsigned long region_hits[MAX_REGIONS]; // transitions into each region, likewise
+   unsigned int last_sequence;
+   int have_sequence;
+   double last_hit_stamp;     // capture time of the last region transition, 0 before the first
+   double flow;               // l/min over the interval between the last two transitions
+   double moved_stamp;        // capture time the needle was last seen moving
+   int idle;                  // not moved for METER_IDLE_DELAY seconds
+   double total;
+   double last_drain;
+   double last_minute;
+   double last_10minute;
+} Meter;
+
+
+/* Detection, in meter.c */
+Meter *meterNew(const char *name, unsigned int org_x, unsigned int org_y, unsigned int org_r,
+                unsigned int regions);
+void meterFree(Meter *m);
+void regionsInit(Meter *m, unsigned int n);
+const Rect *regionDecodeRects(Meter *m, unsigned int *n);
+void regionScores(Meter *m, Image *img, RegionScores *scores);
+int regionHit(Meter *m, Image *img);
+unsigned int regionCountLoop(Meter *m, Image *img, unsigned int i);
+int regionCheck(Meter *m, Image *img);
+int gateInit(MotionGate *g, const Rect *rects, unsigned int n_rects);
+void gateFree(MotionGate *g);
+int gatePass(MotionGate *g, const Frame *frame, double stamp);
+void drawRegion(Image *img, REGION region, unsigned char red, unsigned char green, unsigned char blue);
+double needleAngle(Meter *m, Image *img);
+int updateValues(Meter *m, const RegionScores *scores, double angle, unsigned int sequence, double stamp);
+void meterSkipped(Meter *m, unsigned int n);
+void meterRollup(Meter *m, time_t now);
+
+
+/* Reporting, provided by the program using the meter */
+void publishValues(Meter *m, time_t time, double last_minute, double last_10minute, double last_drain,
+                   double total);
+
+#endif // _METER_H_
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <metrics.h>
+
+// A minimal HTTP server for Prometheus to scrape. It has a thread of its own
+// that takes one connection at a time, and the page is written from counters
+// the pipeline stores atomically, so a scrape never takes a lock the capture,
+// analysis or output threads could be waiting for. A client that stalls only
+// holds up the next scrape, for METRICS_TIMEOUT at most.
+
+// seconds a client has to send its request and take the answer
+#define METRICS_TIMEOUT  2
+
+struct Metrics {
+   int fd;
+   int stop_fd;               // eventfd, readable once metClose wants the thread gone
+   MetricsWriter writer;
+   pthread_t thread;
+};
+
+static void metSend(int fd, const char *buf, size_t len) {
+   ssize_t n;
+
+   while (len > 0) {
+      n = send(fd, buf, len, MSG_NOSIGNAL);
+      if (n <= 0) return;
+      buf += n;
+      len -= n;
+   }
+}
+
+// read the request line and answer it, anything but a GET of /metrics or /
+// is not found
+static void metServe(Metrics *met, int fd) {
+   struct timeval tv = { METRICS_TIMEOUT, 0 };
+   char request[1024];
+   char header[256];
+   char *body = NULL;
+   size_t body_len = 0;
+   size_t len = 0;
+   ssize_t n;
+   FILE *fp;
+
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+   // the headers are not needed, only the request line
+   while (len < sizeof(request) - 1 && !memchr(request, '\n', len)) {
+      n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+      if (n <= 0) return;
+      len += n;
+   }
+   request[len] = '\0';
+
+   if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+      const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      metSend(fd, not_found, strlen(not_found));
+      return;
+   }
+
+   fp = open_memstream(&body, &body_len);
+   if (!fp) return;
+   met->writer(fp);
+   fclose(fp);
+
+   snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", body_len);
+   metSend(fd, header, strlen(header));
+   metSend(fd, body, body_len);
+   free(body);
+}
+
+static void *metThread(void *arg) {
+   Metrics *met = arg;
+   struct pollfd fds[2] = {
+      { met->fd, POLLIN, 0 },
+      { met->stop_fd, POLLIN, 0 }
+   };
+   int fd;
+
+   while (1) {
+      if (poll(fds, 2, -1) == -1 && errno != EINTR) break;
+      if (fds[1].revents) break;
+      if (!(fds[0].revents & POLLIN)) continue;
+
+      fd = accept(met->fd, NULL, NULL);
+      if (fd == -1) continue;
+      metServe(met, fd);
+      close(fd);
+   }
+   return NULL;
+}
+
+// Serve the metrics on port of every interface. Returns NULL if the port
+// cannot be had.
+Metrics *metOpen(int port, MetricsWriter writer) {
+   struct sockaddr_in addr;
+   Metrics *met;
+   int on = 1;
+
+   met = calloc(1, sizeof(*met));
+   if (!met) return NULL;
+   met->writer = writer;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_port = htons(port);
+
+   met->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   met->stop_fd = eventfd(0, EFD_CLOEXEC);
+   if (met->fd == -1 || met->stop_fd == -1 ||
+       setsockopt(met->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+       bind(met->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(met->fd, 8) != 0 ||
+       pthread_create(&met->thread, NULL, metThread, met) != 0) {
+      fprintf(stderr, "Error: metrics on port %d: %s\n", port, strerror(errno));
+      fflush(stderr);
+      if (met->fd != -1) close(met->fd);
+      if (met->stop_fd != -1) close(met->stop_fd);
+      free(met);
+      return NULL;
+   }
+   return met;
+}
+
+void metClose(Metrics *met) {
+   uint64_t one = 1;
+
+   if (write(met->stop_fd, &one, sizeof(one)) == sizeof(one)) pthread_join(met->thread, NULL);
+   close(met->fd);
+   close(met->stop_fd);
+   free(met);
+}
+
+// the HELP and TYPE lines that go before the samples of a metric
+void metHeader(FILE *fp, const char *name, const char *type, const char *help) {
+   fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// append name="value" to a comma separated list of labels, the value escaped
+// as the text format has it
+void metLabel(char *labels, size_t size, const char *name, const char *value) {
+   size_t len = strlen(labels);
+
+   len += snprintf(labels + len, len < size ? size - len : 0, "%s%s=\"", len ? "," : "", name);
+   for (; *value && len + 3 < size; value++) {
+      if (*value == '\\' || *value == '"') labels[len++] = '\\';
+      if (*value == '\n') {
+         labels[len++] = '\\';
+         labels[len++] = 'n';
+      } else {
+         labels[len++] = *value;
+      }
+   }
+   if (len + 1 < size) labels[len++] = '"';
+   if (len < size) labels[len] = '\0';
+}
@@ -0,0 +1,32 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+
+// port the metrics are served on unless told otherwise, 0 turns them off
+#define METRICS_PORT  9101
+
+typedef struct Metrics Metrics;
+
+// writes the Prometheus text exposition of everything there is to see. It
+// runs on the metrics thread, so it may only read what is safe to read from
+// any thread: counters stored atomically and the stats functions.
+typedef void (*MetricsWriter)(FILE *fp);
+
+Metrics *metOpen(int port, MetricsWriter writer);
+void metClose(Metrics *met);
+void metHeader(FILE *fp, const char *name, const char *type, const char *help);
+void metLabel(char *labels, size_t size, const char *name, const char *value);
+
+// doubles shared with the metrics thread, kept whole by atomic stores
+static inline void metSet(double *var, double value) {
+   __atomic_store(var, &value, __ATOMIC_RELAXED);
+}
+
+static inline double metGet(double *var) {
+   double value;
+   __atomic_load(var, &value, __ATOMIC_RELAXED);
+   return value;
+}
+
+#endif // _METRICS_H_
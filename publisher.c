@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mosquitto.h>
+
+#include <publisher.h>
+
+// Readings are queued in memory and sent by a sender thread over mosquitto's
+// own network thread, with QoS 1 so every reading is acknowledged. While the
+// broker is unreachable, or the memory queue is full, readings are appended
+// to the spool file instead, one "topic payload" line each. The spool is
+// replayed in batches once the broker is back and emptied when it has all
+// been acknowledged. Everything in memory is older than anything in the
+// spool, so readings reach the broker in the order they were taken.
+
+typedef struct {
+   char topic[PUB_TOPIC_MAX];
+   char payload[PUB_PAYLOAD_MAX];
+} PubMsg;
+
+struct Publisher {
+   struct mosquitto *mosq;
+   const char *spool_name;
+   int spool_fd;
+   off_t spool_read;          // start of the backlog still to be sent
+   off_t spool_size;
+
+   // memory queue, entries stay until the broker acknowledges them
+   PubMsg queue[PUB_QUEUE_SIZE];
+   unsigned int head;
+   unsigned int tail;
+
+   // batch in flight and the message ids still to be acknowledged, and
+   // acknowledgements that came in before their message id was stored
+   PubMsg batch[PUB_BATCH];
+   int mids[PUB_BATCH];
+   unsigned int batch_len;
+   unsigned int pending;
+   int early[PUB_BATCH];
+   unsigned int n_early;
+
+   int connected;
+   int stop;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+
+   // counters, written with the lock held and read without it by pubStats
+   unsigned long queued;
+   unsigned long spooled;
+   unsigned long sent;
+   unsigned long retried;
+   unsigned long failed;
+   unsigned long lost;
+};
+
+// store a counter any thread may read without the lock
+#define PUB_SET(var, value)  __atomic_store_n(&(var), (value), __ATOMIC_RELAXED)
+#define PUB_GET(var)         __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+
+/* Spool */
+
+// append one reading to the spool, called with the lock held
+static void pubSpool(Publisher *pub, const PubMsg *msg) {
+   char line[PUB_TOPIC_MAX + PUB_PAYLOAD_MAX + 2];
+   int len = snprintf(line, sizeof(line), "%s %s\n", msg->topic, msg->payload);
+
+   if (pub->spool_fd == -1 || write(pub->spool_fd, line, len) != len) {
+      fprintf(stderr, "Error: could not spool reading for %s\n", msg->topic);
+      fflush(stderr);
+      PUB_SET(pub->lost, pub->lost + 1);
+      return;
+   }
+   fdatasync(pub->spool_fd);
+   PUB_SET(pub->spool_size, pub->spool_size + len);
+   PUB_SET(pub->spooled, pub->spooled + 1);
+}
+
+// read the next batch from the spool, returns the number of readings and
+// where the batch ends. Lines that do not parse are skipped.
+static unsigned int pubReadSpool(Publisher *pub, off_t *end) {
+   char buf[PUB_BATCH * (PUB_TOPIC_MAX + PUB_PAYLOAD_MAX + 2)];
+   unsigned int n = 0;
+   ssize_t len = pread(pub->spool_fd, buf, sizeof(buf), pub->spool_read);
+   char *line = buf;
+   char *nl;
+
+   *end = pub->spool_read;
+   if (len <= 0) {
+      // the spool is shorter than we think, start afresh
+      *end = pub->spool_size;
+      return 0;
+   }
+
+   while (n < PUB_BATCH && (nl = memchr(line, '\n', buf + len - line)) != NULL) {
+      char *space = memchr(line, ' ', nl - line);
+      size_t topic_len = space ? space - line : 0;
+      size_t payload_len = space ? nl - space - 1 : 0;
+
+      if (topic_len > 0 && topic_len < PUB_TOPIC_MAX && payload_len < PUB_PAYLOAD_MAX) {
+         memcpy(pub->batch[n].topic, line, topic_len);
+         pub->batch[n].topic[topic_len] = '\0';
+         memcpy(pub->batch[n].payload, space + 1, payload_len);
+         pub->batch[n].payload[payload_len] = '\0';
+         n++;
+      }
+      line = nl + 1;
+   }
+   *end = pub->spool_read + (line - buf);
+
+   // a line cut short by a crash, or one too long to be ours
+   if (line == buf) *end = pub->spool_read + len;
+   return n;
+}
+
+// the backlog has been sent, empty the spool
+static void pubTrimSpool(Publisher *pub) {
+   if (pub->spool_read < pub->spool_size) return;
+   if (ftruncate(pub->spool_fd, 0) != 0) return;
+   PUB_SET(pub->spool_read, 0);
+   PUB_SET(pub->spool_size, 0);
+}
+
+// rewrite the spool as the readings still in memory followed by the part of
+// the backlog not yet sent, so the next start picks up where this one stopped
+static void pubCompactSpool(Publisher *pub) {
+   char tmp_name[256];
+   char buf[4096];
+   ssize_t len;
+   int fd;
+
+   if (pub->head == pub->tail && pub->spool_read == 0) return;
+
+   snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", pub->spool_name);
+   fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+   if (fd == -1) {
+      fprintf(stderr, "Error: could not rewrite spool, %u queued readings lost\n", pub->head - pub->tail);
+      fflush(stderr);
+      PUB_SET(pub->lost, pub->lost + pub->head - pub->tail);
+      return;
+   }
+
+   int spool_fd = pub->spool_fd;
+   off_t spool_read = pub->spool_read;
+   pub->spool_fd = fd;
+   PUB_SET(pub->spool_read, 0);
+   PUB_SET(pub->spool_size, 0);
+   while (pub->tail != pub->head) {
+      pubSpool(pub, &pub->queue[pub->tail % PUB_QUEUE_SIZE]);
+      pub->tail++;
+   }
+   while ((len = pread(spool_fd, buf, sizeof(buf), spool_read)) > 0) {
+      if (write(fd, buf, len) != len) break;
+      spool_read += len;
+      PUB_SET(pub->spool_size, pub->spool_size + len);
+   }
+   fsync(fd);
+   rename(tmp_name, pub->spool_name);
+   close(spool_fd);
+}
+
+
+/* mosquitto callbacks, on mosquitto's network thread */
+
+static void pubOnConnect(struct mosquitto *mosq, void *obj, int rc) {
+   Publisher *pub = obj;
+
+   if (rc != 0) return;
+   pthread_mutex_lock(&pub->lock);
+   PUB_SET(pub->connected, 1);
+   if (pub->spool_size > pub->spool_read) {
+      fprintf(stdout, "Connected to broker, sending %lld bytes of spooled readings\n",
+              (long long)(pub->spool_size - pub->spool_read));
+   } else {
+      fprintf(stdout, "Connected to broker\n");
+   }
+   fflush(stdout);
+   pthread_cond_signal(&pub->cond);
+   pthread_mutex_unlock(&pub->lock);
+}
+
+static void pubOnDisconnect(struct mosquitto *mosq, void *obj, int rc) {
+   Publisher *pub = obj;
+
+   pthread_mutex_lock(&pub->lock);
+   if (pub->connected) {
+      fprintf(stderr, "Error: lost broker connection %d, spooling readings\n", rc);
+      fflush(stderr);
+   }
+   PUB_SET(pub->connected, 0);
+   pthread_cond_signal(&pub->cond);
+   pthread_mutex_unlock(&pub->lock);
+}
+
+static void pubOnPublish(struct mosquitto *mosq, void *obj, int mid) {
+   Publisher *pub = obj;
+   unsigned int i;
+
+   pthread_mutex_lock(&pub->lock);
+   for (i = 0; i < pub->batch_len; i++) {
+      if (pub->mids[i] == mid) {
+         pub->mids[i] = 0;
+         pub->pending--;
+         if (pub->pending == 0) pthread_cond_signal(&pub->cond);
+         break;
+      }
+   }
+   // the sender stores the id once mosquitto_publish returns, which may be
+   // after the broker answered
+   if (i == pub->batch_len && pub->n_early < PUB_BATCH) pub->early[pub->n_early++] = mid;
+   pthread_mutex_unlock(&pub->lock);
+}
+
+// store the id of message i of the batch, or count it acknowledged if the
+// broker already did. Called with the lock held.
+static void pubStoreMid(Publisher *pub, unsigned int i, int mid) {
+   unsigned int k;
+
+   for (k = 0; k < pub->n_early; k++) {
+      if (pub->early[k] == mid) {
+         pub->early[k] = pub->early[--pub->n_early];
+         pub->pending--;
+         return;
+      }
+   }
+   pub->mids[i] = mid;
+}
+
+
+/* Sender thread */
+
+// send the batch and wait for the broker to acknowledge all of it,
+// called with the lock held. Returns 1 once every message is acknowledged.
+static int pubSendBatch(Publisher *pub) {
+   struct timespec deadline;
+   unsigned int i;
+   int rc = MOSQ_ERR_SUCCESS;
+
+   memset(pub->mids, 0, sizeof(pub->mids));
+   pub->pending = pub->batch_len;
+   pub->n_early = 0;
+
+   // the network thread needs the lock for the acknowledgements
+   for (i = 0; i < pub->batch_len && rc == MOSQ_ERR_SUCCESS; i++) {
+      int mid = 0;
+
+      pthread_mutex_unlock(&pub->lock);
+      rc = mosquitto_publish(pub->mosq, &mid, pub->batch[i].topic,
+                             strlen(pub->batch[i].payload), pub->batch[i].payload, 1, true);
+      pthread_mutex_lock(&pub->lock);
+      if (rc == MOSQ_ERR_SUCCESS) pubStoreMid(pub, i, mid);
+   }
+
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   if (rc != MOSQ_ERR_SUCCESS) {
+      PUB_SET(pub->failed, pub->failed + 1);
+      fprintf(stderr, "Error: mosquitto_publish %d, will retry\n", rc);
+      fflush(stderr);
+
+      // give the network thread time to notice the connection is gone
+      deadline.tv_sec += PUB_RECONNECT_MIN;
+      pthread_cond_timedwait(&pub->cond, &pub->lock, &deadline);
+      pub->batch_len = 0;
+      return 0;
+   }
+
+   deadline.tv_sec += PUB_ACK_TIMEOUT;
+   while (pub->pending > 0 && pub->connected && !pub->stop) {
+      if (pthread_cond_timedwait(&pub->cond, &pub->lock, &deadline) == ETIMEDOUT) break;
+   }
+   i = pub->pending == 0;
+   pub->batch_len = 0;
+   return i;
+}
+
+static void *pubThread(void *arg) {
+   Publisher *pub = arg;
+   unsigned int n;
+   off_t end;
+
+   pthread_mutex_lock(&pub->lock);
+   while (!pub->stop) {
+      if (!pub->connected || (pub->head == pub->tail && pub->spool_read == pub->spool_size)) {
+         pthread_cond_wait(&pub->cond, &pub->lock);
+         continue;
+      }
+
+      if (pub->head != pub->tail) {
+         // the memory queue is older than the spool
+         for (n = 0; n < PUB_BATCH && pub->tail + n != pub->head; n++) {
+            pub->batch[n] = pub->queue[(pub->tail + n) % PUB_QUEUE_SIZE];
+         }
+         pub->batch_len = n;
+         if (pubSendBatch(pub)) {
+            pub->tail += n;
+            PUB_SET(pub->sent, pub->sent + n);
+         } else {
+            PUB_SET(pub->retried, pub->retried + n);
+         }
+      } else {
+         pub->batch_len = pubReadSpool(pub, &end);
+         n = pub->batch_len;
+         if (n == 0 || pubSendBatch(pub)) {
+            PUB_SET(pub->spool_read, end);
+            PUB_SET(pub->sent, pub->sent + n);
+            pubTrimSpool(pub);
+         } else {
+            PUB_SET(pub->retried, pub->retried + n);
+         }
+      }
+   }
+   pthread_mutex_unlock(&pub->lock);
+
+   return NULL;
+}
+
+
+// Connect to the broker in the background and start the sender thread.
+// Readings left in the spool by an earlier run are sent first.
+Publisher *pubOpen(const char *host, int port, int keepalive, const char *spool_file) {
+   Publisher *pub = calloc(1, sizeof(*pub));
+   if (!pub) {
+      fprintf(stderr, "Error: Out of memory.\n");
+      return NULL;
+   }
+
+   pub->spool_name = spool_file;
+   pub->spool_fd = open(spool_file, O_RDWR | O_CREAT | O_APPEND, 0644);
+   if (pub->spool_fd == -1) {
+      fprintf(stderr, "Error: cannot open spool '%s': %s, readings are lost while the broker is down\n",
+              spool_file, strerror(errno));
+   } else {
+      PUB_SET(pub->spool_size, lseek(pub->spool_fd, 0, SEEK_END));
+      if (pub->spool_size > 0) {
+         fprintf(stdout, "%lld bytes of readings spooled by an earlier run\n", (long long)pub->spool_size);
+      }
+   }
+
+   mosquitto_lib_init();
+   pub->mosq = mosquitto_new(NULL, true, pub);
+   if (!pub->mosq) {
+      fprintf(stderr, "Error: Out of memory.\n");
+      if (pub->spool_fd != -1) close(pub->spool_fd);
+      free(pub);
+      return NULL;
+   }
+   mosquitto_connect_callback_set(pub->mosq, pubOnConnect);
+   mosquitto_disconnect_callback_set(pub->mosq, pubOnDisconnect);
+   mosquitto_publish_callback_set(pub->mosq, pubOnPublish);
+   mosquitto_reconnect_delay_set(pub->mosq, PUB_RECONNECT_MIN, PUB_RECONNECT_MAX, true);
+
+   pthread_mutex_init(&pub->lock, NULL);
+   pthread_cond_init(&pub->cond, NULL);
+
+   // the network thread keeps reconnecting if the broker is not there yet
+   if (mosquitto_connect_async(pub->mosq, host, port, keepalive) != MOSQ_ERR_SUCCESS) {
+      fprintf(stderr, "Unable to connect, spooling readings until the broker is reachable.\n");
+      fflush(stderr);
+   }
+   mosquitto_loop_start(pub->mosq);
+   pthread_create(&pub->thread, NULL, pubThread, pub);
+
+   return pub;
+}
+
+// Queue a reading, never blocks on the network
+void pubQueue(Publisher *pub, const char *topic, const char *payload) {
+   PubMsg msg;
+
+   snprintf(msg.topic, sizeof(msg.topic), "%s", topic);
+   snprintf(msg.payload, sizeof(msg.payload), "%s", payload);
+
+   pthread_mutex_lock(&pub->lock);
+   if (pub->connected && pub->spool_read == pub->spool_size &&
+       pub->head - pub->tail < PUB_QUEUE_SIZE) {
+      pub->queue[pub->head % PUB_QUEUE_SIZE] = msg;
+      pub->head++;
+      PUB_SET(pub->queued, pub->queued + 1);
+      pthread_cond_signal(&pub->cond);
+   } else {
+      pubSpool(pub, &msg);
+   }
+   pthread_mutex_unlock(&pub->lock);
+}
+
+// Counters, safe to call from any thread. They are read without the lock,
+// so this never waits on the broker.
+void pubStats(Publisher *pub, PubStats *stats) {
+   stats->queued = PUB_GET(pub->queued);
+   stats->spooled = PUB_GET(pub->spooled);
+   stats->sent = PUB_GET(pub->sent);
+   stats->retried = PUB_GET(pub->retried);
+   stats->failed = PUB_GET(pub->failed);
+   stats->lost = PUB_GET(pub->lost);
+   stats->backlog = PUB_GET(pub->spool_size) - PUB_GET(pub->spool_read);
+   stats->connected = PUB_GET(pub->connected);
+}
+
+// Stop sending, keep whatever has not been acknowledged in the spool and
+// disconnect
+void pubClose(Publisher *pub) {
+   pthread_mutex_lock(&pub->lock);
+   pub->stop = 1;
+   pthread_cond_signal(&pub->cond);
+   pthread_mutex_unlock(&pub->lock);
+   pthread_join(pub->thread, NULL);
+
+   mosquitto_disconnect(pub->mosq);
+   mosquitto_loop_stop(pub->mosq, false);
+
+   if (pub->spool_fd != -1) {
+      pubCompactSpool(pub);
+      close(pub->spool_fd);
+   }
+
+   fprintf(stdout, "Publisher: %lu sent, %lu spooled, %lu lost, %lld bytes left in the spool\n",
+           pub->sent, pub->spooled, pub->lost, (long long)(pub->spool_size - pub->spool_read));
+   fflush(stdout);
+
+   mosquitto_destroy(pub->mosq);
+   mosquitto_lib_cleanup();
+   pthread_mutex_destroy(&pub->lock);
+   pthread_cond_destroy(&pub->cond);
+   free(pub);
+}
@@ -0,0 +1,36 @@
+#ifndef _PUBLISHER_H_
+#define _PUBLISHER_H_
+
+// readings held in memory while the broker keeps up, anything beyond that or
+// sent while the broker is unreachable goes to the spool file
+#define PUB_QUEUE_SIZE      256
+// messages sent before waiting for the broker to acknowledge them
+#define PUB_BATCH            16
+// seconds to wait for a batch to be acknowledged before sending it again
+#define PUB_ACK_TIMEOUT      30
+// reconnect backoff in seconds, doubling from the min up to the max
+#define PUB_RECONNECT_MIN     1
+#define PUB_RECONNECT_MAX   300
+
+#define PUB_TOPIC_MAX        64
+#define PUB_PAYLOAD_MAX     200
+
+typedef struct Publisher Publisher;
+
+typedef struct {
+   unsigned long queued;      // readings queued in memory
+   unsigned long spooled;     // readings written to the spool
+   unsigned long sent;        // readings acknowledged by the broker
+   unsigned long retried;     // readings sent again, not acknowledged in time
+   unsigned long failed;      // batches mosquitto would not send
+   unsigned long lost;        // readings neither queued nor spooled
+   unsigned long backlog;     // bytes in the spool still to be sent
+   int connected;
+} PubStats;
+
+Publisher *pubOpen(const char *host, int port, int keepalive, const char *spool_file);
+void pubQueue(Publisher *pub, const char *topic, const char *payload);
+void pubStats(Publisher *pub, PubStats *stats);
+void pubClose(Publisher *pub);
+
+#endif // _PUBLISHER_H_
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <history.h>
+
+// Flow between two times from the history the water meter keeps, e.g.
+//
+//   water-meter-query -from "2026-10-13 02:00" -to "2026-10-13 04:00" -step 600
+//
+// prints the litres and average flow of every 10 minutes and of the whole
+// range. The history is mmap'd and searched in place, so it can be asked while
+// the water meter writes to it.
+
+#define WATER_METER_HISTORY_FILE "/home/pi/logs/water-meter-history"
+
+// local time as YYYY-MM-DD [HH:MM[:SS]], or seconds since the epoch with a
+// leading @. Returns -1 if it is neither.
+static time_t parseTime(const char *s) {
+   struct tm tm;
+   int n;
+
+   if (s[0] == '@') return (time_t)atoll(s + 1);
+
+   memset(&tm, 0, sizeof(tm));
+   n = sscanf(s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+   if (n != 3 && n < 5) return -1;
+   tm.tm_year -= 1900;
+   tm.tm_mon -= 1;
+   tm.tm_isdst = -1;
+   return mktime(&tm);
+}
+
+static const char *formatTime(time_t t, char *buf, size_t size) {
+   struct tm tm;
+
+   localtime_r(&t, &tm);
+   strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+   return buf;
+}
+
+static void usage(void) {
+   fprintf(stderr, "usage: water-meter-query [-name meter] [-file history] [-from time] [-to time] [-step seconds]\n"
+                   "times are YYYY-MM-DD [HH:MM[:SS]] local time or @seconds, the default is the last 24 hours\n");
+}
+
+int main(int argc, char * argv[])
+{
+   int    i;
+   char   file[256];
+   char   *name = NULL;
+   char   *history_file = NULL;
+   time_t to = time(0);
+   time_t from = to - 24 * 3600;
+   long   step = 0;
+   char   a[32], b[32];
+   History *h;
+
+   for (i = 1; i < argc; i++) {
+      if (i + 1 < argc && strcmp(argv[i], "-name") == 0) {
+         name = argv[++i];
+      } else if (i + 1 < argc && strcmp(argv[i], "-file") == 0) {
+         history_file = argv[++i];
+      } else if (i + 1 < argc && strcmp(argv[i], "-from") == 0) {
+         from = parseTime(argv[++i]);
+      } else if (i + 1 < argc && strcmp(argv[i], "-to") == 0) {
+         to = parseTime(argv[++i]);
+      } else if (i + 1 < argc && strcmp(argv[i], "-step") == 0) {
+         step = atol(argv[++i]);
+      } else {
+         usage();
+         return 1;
+      }
+   }
+   if (from == -1 || to == -1 || to < from || step < 0) {
+      usage();
+      return 1;
+   }
+
+   // each named meter keeps its own history, as the water meter names them
+   if (history_file) {
+      snprintf(file, sizeof(file), "%s", history_file);
+   } else if (name) {
+      snprintf(file, sizeof(file), "%s-%s", WATER_METER_HISTORY_FILE, name);
+   } else {
+      snprintf(file, sizeof(file), "%s", WATER_METER_HISTORY_FILE);
+   }
+
+   h = histOpen(file, 0, 0);
+   if (!h) return 1;
+
+   uint64_t n = histCount(h);
+   uint64_t r = histFind(h, from);
+   double   litres = 0.0, peak = 0.0;
+   unsigned long seconds = 0;
+
+   if (n && histRecord(h, 0)->time > from) {
+      fprintf(stdout, "History starts %s\n", formatTime(histRecord(h, 0)->time, a, sizeof(a)));
+   }
+
+   // one line per step, empty steps included so the lines are evenly spaced
+   time_t bucket = from;
+   double bucket_litres = 0.0;
+
+   for (; r < n && histRecord(h, r)->time < to; r++) {
+      const HistRecord *rec = histRecord(h, r);
+
+      while (step && rec->time >= bucket + step) {
+         fprintf(stdout, "%s  %8.2f l  %6.2f l/min\n", formatTime(bucket, a, sizeof(a)),
+                 bucket_litres, bucket_litres * 60.0 / step);
+         bucket += step;
+         bucket_litres = 0.0;
+      }
+      bucket_litres += rec->litres;
+      litres += rec->litres;
+      seconds++;
+      if (rec->litres * 60.0 > peak) peak = rec->litres * 60.0;
+   }
+   while (step && bucket < to) {
+      fprintf(stdout, "%s  %8.2f l  %6.2f l/min\n", formatTime(bucket, a, sizeof(a)),
+              bucket_litres, bucket_litres * 60.0 / step);
+      bucket += step;
+      bucket_litres = 0.0;
+   }
+
+   fprintf(stdout, "%s - %s: %.2f l, %.2f l/min average, %lu s of flow, peak %.2f l/min\n",
+           formatTime(from, a, sizeof(a)), formatTime(to, b, sizeof(b)), litres,
+           to > from ? litres * 60.0 / (to - from) : 0.0, seconds, peak);
+
+   histClose(h);
+   return 0;
+}
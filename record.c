@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "imgproc.h"
+
+
+// frames buffered between the capture loop and the writer thread
+#define REC_SLOTS		32
+
+// data is handed to the kernel in chunks of this size
+#define REC_WRITE_CHUNK	(1024 * 1024)
+
+
+typedef struct {
+	RecFrame head;
+	unsigned char * data;
+} RecSlot;
+
+
+struct Recorder {
+	int fd;
+	char * name;
+	RecHeader header;
+	size_t frame_size;
+
+	// slots filled by the capture loop and drained by the writer
+	RecSlot slots[REC_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+
+	// writer thread state
+	unsigned char * chunk;
+	size_t chunk_used;
+	uint64_t offset;
+	uint64_t * index;
+	unsigned int index_size;
+	int failed;
+
+	unsigned long written;
+	unsigned long dropped;
+};
+
+
+// write a whole buffer, retrying on short writes
+static int writeAll(int fd, const void * buf, size_t len)
+{
+	const unsigned char * p = buf;
+
+	while(len > 0){
+		ssize_t r = write(fd, p, len);
+		if(r == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+// hand the chunk to the kernel and drop the written pages from the cache
+static void recFlush(Recorder * rec)
+{
+	if(rec->chunk_used == 0 || rec->failed){
+		rec->chunk_used = 0;
+		return;
+	}
+
+	off_t start = lseek(rec->fd, 0, SEEK_CUR);
+	if(writeAll(rec->fd, rec->chunk, rec->chunk_used) == -1){
+		fprintf(stderr, "%s: write error %d, %s\n", rec->name, errno, strerror(errno));
+		rec->failed = 1;
+	} else {
+		fdatasync(rec->fd);
+		posix_fadvise(rec->fd, start, rec->chunk_used, POSIX_FADV_DONTNEED);
+	}
+	rec->chunk_used = 0;
+}
+
+
+// append bytes to the current chunk, flushing as it fills
+static void recAppend(Recorder * rec, const void * data, size_t len)
+{
+	const unsigned char * p = data;
+
+	while(len > 0){
+		size_t n = REC_WRITE_CHUNK - rec->chunk_used;
+		if(n > len){
+			n = len;
+		}
+		memcpy(rec->chunk + rec->chunk_used, p, n);
+		rec->chunk_used += n;
+		p += n;
+		len -= n;
+		if(rec->chunk_used == REC_WRITE_CHUNK){
+			recFlush(rec);
+		}
+	}
+}
+
+
+// write one frame record and note its offset in the index
+static void recStore(Recorder * rec, RecSlot * slot)
+{
+	static const unsigned char pad[8];
+	size_t len = slot->head.bytesused;
+	size_t padding = (8 - len % 8) % 8;
+
+	if(rec->header.n_frames == rec->index_size){
+		unsigned int size = rec->index_size ? rec->index_size * 2 : 1024;
+		uint64_t * index = realloc(rec->index, size * sizeof(*index));
+		if(index == NULL){
+			fprintf(stderr, "%s: out of memory for the index\n", rec->name);
+			rec->failed = 1;
+			return;
+		}
+		rec->index = index;
+		rec->index_size = size;
+	}
+	rec->index[rec->header.n_frames++] = rec->offset;
+
+	recAppend(rec, &slot->head, sizeof(slot->head));
+	recAppend(rec, slot->data, len);
+	recAppend(rec, pad, padding);
+	rec->offset += sizeof(slot->head) + len + padding;
+}
+
+
+static void * recThread(void * arg)
+{
+	Recorder * rec = arg;
+
+	pthread_mutex_lock(&rec->lock);
+	while(1){
+		while(rec->head == rec->tail && !rec->stop){
+			pthread_cond_wait(&rec->cond, &rec->lock);
+		}
+		if(rec->head == rec->tail){
+			break;
+		}
+		RecSlot * slot = &rec->slots[rec->tail % REC_SLOTS];
+		pthread_mutex_unlock(&rec->lock);
+
+		// the slot is ours until tail moves on
+		recStore(rec, slot);
+
+		pthread_mutex_lock(&rec->lock);
+		rec->tail++;
+		rec->written++;
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	return NULL;
+}
+
+
+// Create a recording of frames in the camera's format. Frames are copied by
+// recWriteFrame and written out by a background thread.
+Recorder * recOpen(const char * filename, Camera * cam)
+{
+	Recorder * rec = calloc(1, sizeof(*rec));
+	if(rec == NULL){
+		fprintf(stderr, "Could not allocate memory for recorder\n");
+		return NULL;
+	}
+
+	rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(rec->fd == -1){
+		fprintf(stderr, "Cannot open '%s': %d, %s\n",
+			filename, errno, strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	rec->name = (char *)filename;
+	rec->frame_size = (size_t)cam->stride * cam->height;
+	rec->chunk = malloc(REC_WRITE_CHUNK);
+	int failed = rec->chunk == NULL;
+	for(unsigned int i = 0; i < REC_SLOTS; i++){
+		rec->slots[i].data = malloc(rec->frame_size);
+		failed |= rec->slots[i].data == NULL;
+	}
+	if(failed){
+		fprintf(stderr, "Could not allocate memory for recorder buffers\n");
+		for(unsigned int i = 0; i < REC_SLOTS; i++){
+			free(rec->slots[i].data);
+		}
+		free(rec->chunk);
+		close(rec->fd);
+		free(rec);
+		return NULL;
+	}
+
+	// the header is rewritten with the index location when the recording is closed
+	memcpy(rec->header.magic, REC_MAGIC, sizeof(rec->header.magic));
+	rec->header.width = cam->width;
+	rec->header.height = cam->height;
+	rec->header.pixelformat = cam->pixelformat;
+	rec->header.stride = cam->stride;
+	recAppend(rec, &rec->header, sizeof(rec->header));
+	rec->offset = sizeof(rec->header);
+
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+	pthread_create(&rec->thread, NULL, recThread, rec);
+
+	return rec;
+}
+
+
+// Queue a copy of a borrowed frame for writing. Never blocks on the disk,
+// returns -1 and counts a drop when the writer has fallen behind.
+int recWriteFrame(Recorder * rec, const Frame * frame)
+{
+	pthread_mutex_lock(&rec->lock);
+	int full = rec->head - rec->tail == REC_SLOTS;
+	if(full){
+		rec->dropped++;
+	}
+	pthread_mutex_unlock(&rec->lock);
+	if(full){
+		return -1;
+	}
+
+	// the writer never touches the slot at head
+	RecSlot * slot = &rec->slots[rec->head % REC_SLOTS];
+	size_t len = frame->bytesused;
+	if(len == 0 || len > rec->frame_size){
+		len = rec->frame_size;
+	}
+	slot->head.sequence = frame->sequence;
+	slot->head.bytesused = len;
+	slot->head.timestamp_us = (int64_t)frame->timestamp.tv_sec * 1000000 + frame->timestamp.tv_usec;
+	memcpy(slot->data, frame->data, len);
+
+	pthread_mutex_lock(&rec->lock);
+	rec->head++;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+
+	return 0;
+}
+
+
+// Frames written and dropped so far
+void recStats(Recorder * rec, unsigned long * written, unsigned long * dropped)
+{
+	pthread_mutex_lock(&rec->lock);
+	*written = rec->written;
+	*dropped = rec->dropped;
+	pthread_mutex_unlock(&rec->lock);
+}
+
+
+// Write out the queued frames and the index, then close the recording
+void recClose(Recorder * rec)
+{
+	pthread_mutex_lock(&rec->lock);
+	rec->stop = 1;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+
+	// the index follows the last frame
+	rec->header.index_offset = rec->offset;
+	recAppend(rec, rec->index, rec->header.n_frames * sizeof(*rec->index));
+	recFlush(rec);
+
+	if(!rec->failed){
+		if(pwrite(rec->fd, &rec->header, sizeof(rec->header), 0) != sizeof(rec->header)){
+			fprintf(stderr, "%s: error writing header %d, %s\n", rec->name, errno, strerror(errno));
+		}
+		fsync(rec->fd);
+	}
+	close(rec->fd);
+
+	fprintf(stdout, "%s: %lu frames written, %lu dropped\n", rec->name, rec->written, rec->dropped);
+	fflush(stdout);
+
+	pthread_mutex_destroy(&rec->lock);
+	pthread_cond_destroy(&rec->cond);
+	for(unsigned int i = 0; i < REC_SLOTS; i++){
+		free(rec->slots[i].data);
+	}
+	free(rec->chunk);
+	free(rec->index);
+	free(rec);
+}
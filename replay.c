@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "imgproc.h"
+
+
+// raw captures carry no timing, they are played back at this rate
+#define REPLAY_RAW_FPS	30
+
+
+// state of a replayed capture file
+typedef struct {
+	const unsigned char * map;
+	size_t map_size;
+	size_t frame_size;
+	unsigned int n_frames;
+	unsigned int next;
+	int realtime;
+	struct timespec start;
+
+	// recordings made with recOpen, offsets of every RecFrame in the file
+	const uint64_t * offsets;
+	uint64_t * scanned;
+	int64_t first_us;
+} Replay;
+
+
+// make the timer fd readable at the given time, or straight away
+static void replayArm(Camera * cam, const struct timespec * due)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if(due != NULL){
+		its.it_value = *due;
+		timerfd_settime(cam->wait_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	} else {
+		its.it_value.tv_nsec = 1;
+		timerfd_settime(cam->wait_fd, 0, &its, NULL);
+	}
+}
+
+
+// add a number of microseconds to a timespec
+static void tsAddUsec(struct timespec * ts, uint64_t usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if(ts->tv_nsec >= 1000000000){
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+static int replayBorrow(Camera * cam, Frame * frame)
+{
+	Replay * rp = cam->priv;
+	uint64_t expirations;
+
+	// the timer only says when to look again
+	while(read(cam->wait_fd, &expirations, sizeof(expirations)) == -1 && errno == EINTR);
+
+	if(rp->next >= rp->n_frames){
+		return -1;
+	}
+
+	uint64_t usec = (uint64_t)rp->next * 1000000 / REPLAY_RAW_FPS;
+	unsigned int sequence = rp->next;
+	size_t bytesused = rp->frame_size;
+	const unsigned char * data = rp->map + (size_t)rp->next * rp->frame_size;
+
+	// recordings carry their own timing
+	if(rp->offsets != NULL){
+		const RecFrame * rf = (const RecFrame *)(rp->map + rp->offsets[rp->next]);
+		usec = rf->timestamp_us - rp->first_us;
+		sequence = rf->sequence;
+		bytesused = rf->bytesused;
+		data = (const unsigned char *)(rf + 1);
+	}
+
+	// not due yet, the timer fires when it is
+	if(rp->realtime){
+		struct timespec due = rp->start;
+		struct timespec now;
+		tsAddUsec(&due, usec);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec)){
+			replayArm(cam, &due);
+			return 1;
+		}
+	}
+
+	frame->width = cam->width;
+	frame->height = cam->height;
+	frame->stride = cam->stride;
+	frame->pixelformat = cam->pixelformat;
+	frame->sequence = sequence;
+	frame->timestamp.tv_sec = usec / 1000000;
+	frame->timestamp.tv_usec = usec % 1000000;
+	frame->bytesused = bytesused;
+	frame->data = data;
+	frame->index = rp->next;
+
+	rp->next++;
+
+	// the next frame may already be due
+	replayArm(cam, NULL);
+	return 0;
+}
+
+
+static void replayRelease(Camera * cam, Frame * frame)
+{
+	// frames point into the read only mapping, nothing to hand back
+}
+
+
+static void replayClose(Camera * cam)
+{
+	Replay * rp = cam->priv;
+
+	munmap((void *)rp->map, rp->map_size);
+	close(cam->handle);
+	close(cam->wait_fd);
+	cam->handle = -1;
+	free(rp->scanned);
+	free(rp);
+}
+
+
+// Whether there is a whole frame record at offset in the recording, of no
+// more than frame_max bytes.
+static int replayFrameOk(const Replay * rp, uint64_t offset, size_t frame_max)
+{
+	if(offset < sizeof(RecHeader) || offset % 8 != 0 || offset > rp->map_size ||
+	   rp->map_size - offset < sizeof(RecFrame)){
+		return 0;
+	}
+	const RecFrame * rf = (const RecFrame *)(rp->map + offset);
+	return rf->bytesused != 0 && rf->bytesused <= frame_max &&
+	       rf->bytesused <= rp->map_size - offset - sizeof(RecFrame);
+}
+
+
+// Find the frames of a recording, through its index or, when the recording
+// was never closed or the index does not fit it, by walking the frame
+// records. Returns 0 on success.
+static int replayIndex(Replay * rp, const RecHeader * hdr)
+{
+	size_t frame_max = (size_t)hdr->stride * hdr->height;
+	int indexed = hdr->index_offset != 0 && hdr->index_offset % 8 == 0 && hdr->index_offset <= rp->map_size &&
+		      (uint64_t)hdr->n_frames * sizeof(uint64_t) <= rp->map_size - hdr->index_offset;
+
+	// every frame the index points at has to be there
+	if(indexed){
+		const uint64_t * offsets = (const uint64_t *)(rp->map + hdr->index_offset);
+		for(unsigned int i = 0; i < hdr->n_frames; i++){
+			if(!replayFrameOk(rp, offsets[i], frame_max)){
+				fprintf(stderr, "Recording index entry %u of %u is bad\n", i, hdr->n_frames);
+				indexed = 0;
+				break;
+			}
+		}
+	}
+
+	if(indexed){
+		rp->offsets = (const uint64_t *)(rp->map + hdr->index_offset);
+		rp->n_frames = hdr->n_frames;
+	} else {
+		unsigned int size = 0;
+		uint64_t offset = sizeof(*hdr);
+
+		while(replayFrameOk(rp, offset, frame_max)){
+			const RecFrame * rf = (const RecFrame *)(rp->map + offset);
+			if(rp->n_frames == size){
+				size = size ? size * 2 : 1024;
+				uint64_t * scanned = realloc(rp->scanned, size * sizeof(*scanned));
+				if(scanned == NULL){
+					return -1;
+				}
+				rp->scanned = scanned;
+			}
+			rp->scanned[rp->n_frames++] = offset;
+			offset += sizeof(RecFrame) + ((rf->bytesused + 7) & ~(size_t)7);
+		}
+		rp->offsets = rp->scanned;
+		fprintf(stderr, "Recording has no usable index, found %u frames\n", rp->n_frames);
+	}
+
+	if(rp->n_frames > 0){
+		rp->first_us = ((const RecFrame *)(rp->map + rp->offsets[0]))->timestamp_us;
+	}
+	return 0;
+}
+
+
+static const struct FrameSource replay_source = {
+	"replay",
+	replayBorrow,
+	replayRelease,
+	replayClose,
+	NULL,
+	NULL
+};
+
+
+// Open a recorded capture, either a recording made with recOpen or raw YUYV
+// frames of the given size. The file is mmap'd and frames are handed out in
+// place. With realtime set the frames are paced as they were captured,
+// otherwise they come as fast as they are asked for. Either way the camera's
+// wait fd is a timer that fires when the next frame is due.
+Camera * camOpenReplay(const char * filename, unsigned int width, unsigned int height, int realtime)
+{
+	struct stat st;
+
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1){
+		fprintf(stderr, "Cannot open '%s': %d, %s\n",
+			filename, errno, strerror(errno));
+		return NULL;
+	}
+
+	if(fstat(fd, &st) == -1 || st.st_size == 0){
+		fprintf(stderr, "'%s' is empty\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	Camera * cam = calloc(1, sizeof(*cam));
+	Replay * rp = calloc(1, sizeof(*rp));
+	if(cam == NULL || rp == NULL){
+		fprintf(stderr, "Could not allocate memory for replay structure\n");
+		free(cam);
+		free(rp);
+		close(fd);
+		return NULL;
+	}
+
+	rp->map_size = st.st_size;
+	rp->map = mmap(NULL, rp->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(rp->map == MAP_FAILED){
+		fprintf(stderr, "mmap error %d, %s\n", errno, strerror(errno));
+		free(cam);
+		free(rp);
+		close(fd);
+		return NULL;
+	}
+
+	// frames are read front to back
+	madvise((void *)rp->map, rp->map_size, MADV_SEQUENTIAL);
+
+	cam->width = width;
+	cam->height = height;
+	cam->stride = width * 2;
+	cam->pixelformat = V4L2_PIX_FMT_YUYV;
+
+	const RecHeader * hdr = (const RecHeader *)rp->map;
+	if(rp->map_size >= sizeof(*hdr) && memcmp(hdr->magic, REC_MAGIC, sizeof(hdr->magic)) == 0){
+		// the recording knows its own format
+		cam->width = hdr->width;
+		cam->height = hdr->height;
+		cam->stride = hdr->stride;
+		cam->pixelformat = hdr->pixelformat;
+		if(replayIndex(rp, hdr) != 0){
+			fprintf(stderr, "Could not allocate memory for replay index\n");
+			munmap((void *)rp->map, rp->map_size);
+			free(rp->scanned);
+			free(cam);
+			free(rp);
+			close(fd);
+			return NULL;
+		}
+	} else {
+		rp->frame_size = (size_t)width * height * 2;
+		rp->n_frames = rp->map_size / rp->frame_size;
+	}
+
+	rp->realtime = realtime;
+	clock_gettime(CLOCK_MONOTONIC, &rp->start);
+
+	cam->wait_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(cam->wait_fd == -1){
+		fprintf(stderr, "timerfd error %d, %s\n", errno, strerror(errno));
+		munmap((void *)rp->map, rp->map_size);
+		free(rp->scanned);
+		free(cam);
+		free(rp);
+		close(fd);
+		return NULL;
+	}
+	replayArm(cam, NULL);
+
+	cam->name = (char *)filename;
+	cam->handle = fd;
+	cam->source = &replay_source;
+	cam->priv = rp;
+
+	return cam;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+
+#define CACHE_LINE	64
+
+
+// producer and consumer indices live on their own cache lines. Indices run
+// freely and are masked on access, so head - tail is the fill level.
+struct Ring {
+	unsigned int size;
+	unsigned int mask;
+	unsigned int elem_size;
+	RingPolicy policy;
+	unsigned char * slots;
+
+	// signalled on every push and on close, the consumer sleeps on it
+	int data_fd;
+	// signalled on every pop of a blocking ring, the producer sleeps on it
+	int space_fd;
+
+	unsigned int head __attribute__((aligned(CACHE_LINE)));
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned long stalls;
+	unsigned int high_water;
+	int closed;
+
+	unsigned int tail __attribute__((aligned(CACHE_LINE)));
+};
+
+
+// wake whoever sleeps on an eventfd
+static void ringSignal(int fd)
+{
+	uint64_t one = 1;
+	while(write(fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+
+// wait for an eventfd to be signalled and reset it, returns 0 on timeout
+static int ringSleep(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t count;
+
+	int r = poll(&pfd, 1, timeout_ms);
+	if(r > 0){
+		while(read(fd, &count, sizeof(count)) == -1 && errno == EINTR);
+	}
+	return r > 0;
+}
+
+
+// Create a ring of at least size elements, rounded up to a power of two
+Ring * ringNew(unsigned int size, unsigned int elem_size, RingPolicy policy)
+{
+	Ring * ring;
+	unsigned int n = 2;
+
+	while(n < size){
+		n <<= 1;
+	}
+
+	if(posix_memalign((void **)&ring, CACHE_LINE, sizeof(*ring)) != 0){
+		fprintf(stderr, "Could not allocate memory for ring\n");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+
+	ring->size = n;
+	ring->mask = n - 1;
+	ring->elem_size = elem_size;
+	ring->policy = policy;
+	ring->slots = malloc((size_t)n * elem_size);
+	ring->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(ring->slots == NULL || ring->data_fd == -1 || ring->space_fd == -1){
+		fprintf(stderr, "Could not set up ring\n");
+		ringFree(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+
+void ringFree(Ring * ring)
+{
+	if(ring->data_fd > 0) close(ring->data_fd);
+	if(ring->space_fd > 0) close(ring->space_fd);
+	free(ring->slots);
+	free(ring);
+}
+
+
+// Producer side. Returns 0 when the element was queued, -1 when it was
+// dropped because the ring is full (RING_DROP) or closed.
+int ringPush(Ring * ring, const void * elem)
+{
+	unsigned int head = ring->head;
+
+	if(ring->closed){
+		return -1;
+	}
+
+	while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->size){
+		if(ring->policy == RING_DROP){
+			__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		__atomic_store_n(&ring->stalls, ring->stalls + 1, __ATOMIC_RELAXED);
+		ringSleep(ring->space_fd, 100);
+	}
+
+	memcpy(ring->slots + (size_t)(head & ring->mask) * ring->elem_size, elem, ring->elem_size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	unsigned int fill = head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	if(fill > ring->high_water){
+		__atomic_store_n(&ring->high_water, fill, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+
+	ringSignal(ring->data_fd);
+	return 0;
+}
+
+
+// Consumer side. Returns 0 and copies out the oldest element, -1 if empty.
+int ringPop(Ring * ring, void * elem)
+{
+	unsigned int tail = ring->tail;
+
+	if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+		return -1;
+	}
+
+	memcpy(elem, ring->slots + (size_t)(tail & ring->mask) * ring->elem_size, ring->elem_size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	if(ring->policy == RING_BLOCK){
+		ringSignal(ring->space_fd);
+	}
+	return 0;
+}
+
+
+// Consumer side. Wait until there is something to pop, returns 1 if there is,
+// 0 on timeout and -1 once the ring is closed and drained. A negative
+// timeout waits forever.
+int ringWait(Ring * ring, int timeout_ms)
+{
+	while(1){
+		if(ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+			return 1;
+		}
+		if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)){
+			return -1;
+		}
+		if(!ringSleep(ring->data_fd, timeout_ms)){
+			return 0;
+		}
+	}
+}
+
+
+// Producer side. No more elements will be pushed, wakes the consumer.
+void ringClose(Ring * ring)
+{
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+	ringSignal(ring->data_fd);
+}
+
+
+int ringClosed(Ring * ring)
+{
+	return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
+
+
+// eventfd that becomes readable when elements are pushed, for poll/epoll
+int ringFd(Ring * ring)
+{
+	return ring->data_fd;
+}
+
+
+// Consumer side, for callers polling ringFd. Resets the eventfd, pop
+// everything afterwards so no push goes unnoticed.
+void ringAck(Ring * ring)
+{
+	uint64_t count;
+	while(read(ring->data_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+}
+
+
+// Counters, safe to read from any thread
+void ringStats(Ring * ring, RingStats * stats)
+{
+	stats->pushed = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	stats->stalls = __atomic_load_n(&ring->stalls, __ATOMIC_RELAXED);
+	stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+}
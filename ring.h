@@ -0,0 +1,39 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+// Bounded single-producer/single-consumer ring of fixed size elements.
+// Exactly one thread may push and one thread may pop.
+
+// what a push does when the ring is full
+typedef enum {
+	RING_DROP,	// discard the new element and count it
+	RING_BLOCK	// wait for the consumer to make room
+} RingPolicy;
+
+
+typedef struct {
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned long stalls;
+	unsigned int high_water;
+} RingStats;
+
+
+typedef struct Ring Ring;
+
+
+Ring * ringNew(unsigned int size, unsigned int elem_size, RingPolicy policy);
+void ringFree(Ring * ring);
+
+int ringPush(Ring * ring, const void * elem);
+int ringPop(Ring * ring, void * elem);
+int ringWait(Ring * ring, int timeout_ms);
+void ringClose(Ring * ring);
+int ringClosed(Ring * ring);
+int ringFd(Ring * ring);
+void ringAck(Ring * ring);
+
+void ringStats(Ring * ring, RingStats * stats);
+
+
+#endif // _RING_H_
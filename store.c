@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <store.h>
+
+// The total is kept in a pre-allocated page holding two copies of a small
+// checksummed record, each in its own disk sector. A new total goes into the
+// copy that is not the latest, so a write torn by a power cut only ever
+// damages the older copy, and at startup the newest copy with a good checksum
+// wins. Totals are held in memory and written at most once per sync interval,
+// one page each time, however often they change.
+
+#define STORE_MAGIC    0x4c544d57        // "WMTL"
+#define STORE_SLOT     512
+#define STORE_SIZE     4096
+
+typedef struct {
+   uint32_t magic;
+   uint32_t crc;              // of everything after it
+   uint64_t seq;              // the newer copy has the higher one
+   double total;
+   int64_t time;              // wall clock of the write
+} StoreRecord;
+
+struct Store {
+   const char *name;
+   int fd;
+   unsigned char *map;
+   int sync_interval;
+   uint64_t seq;
+   double total;
+   int loaded;                // total came from the file
+   int dirty;
+   struct timespec last_sync;
+};
+
+
+static uint32_t storeCrc(const void *data, size_t len) {
+   const unsigned char *p = data;
+   uint32_t crc = ~0u;
+   int k;
+
+   while (len--) {
+      crc ^= *p++;
+      for (k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+static const StoreRecord *storeSlot(Store *store, unsigned int i) {
+   return (const StoreRecord *)(store->map + i * STORE_SLOT);
+}
+
+static int storeValid(const StoreRecord *rec) {
+   return rec->magic == STORE_MAGIC && isfinite(rec->total) &&
+          rec->crc == storeCrc(&rec->seq, sizeof(*rec) - offsetof(StoreRecord, seq));
+}
+
+// pick up the newest copy that is intact, the next write goes over the other
+static void storeRecover(Store *store) {
+   const StoreRecord *a = storeSlot(store, 0);
+   const StoreRecord *b = storeSlot(store, 1);
+   const StoreRecord *rec = NULL;
+
+   if (storeValid(a)) rec = a;
+   if (storeValid(b) && (!rec || b->seq > rec->seq)) rec = b;
+   if (!rec) return;
+
+   store->seq = rec->seq;
+   store->total = rec->total;
+   store->loaded = 1;
+}
+
+// Open the store, creating and pre-allocating it if need be. The total is only
+// written out by storeSet and storeSync. Returns NULL if the file cannot be used.
+Store *storeOpen(const char *file, int sync_interval) {
+   Store *store;
+   struct stat st;
+
+   store = calloc(1, sizeof(*store));
+   if (!store) return NULL;
+   store->name = file;
+   store->sync_interval = sync_interval;
+   clock_gettime(CLOCK_MONOTONIC, &store->last_sync);
+
+   store->fd = open(file, O_RDWR | O_CREAT, 0644);
+   if (store->fd == -1 || fstat(store->fd, &st) == -1) {
+      fprintf(stderr, "Error: could not open %s: %s\n", file, strerror(errno));
+      fflush(stderr);
+      if (store->fd != -1) close(store->fd);
+      free(store);
+      return NULL;
+   }
+
+   // the space is taken once, so a full disk cannot stop a later write
+   if (st.st_size < STORE_SIZE) {
+      if (posix_fallocate(store->fd, 0, STORE_SIZE) != 0 && ftruncate(store->fd, STORE_SIZE) == -1) {
+         fprintf(stderr, "Error: could not allocate %s: %s\n", file, strerror(errno));
+         fflush(stderr);
+         close(store->fd);
+         free(store);
+         return NULL;
+      }
+      fsync(store->fd);
+   }
+
+   store->map = mmap(NULL, STORE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+   if (store->map == MAP_FAILED) {
+      fprintf(stderr, "Error: could not map %s: %s\n", file, strerror(errno));
+      fflush(stderr);
+      close(store->fd);
+      free(store);
+      return NULL;
+   }
+   storeRecover(store);
+   return store;
+}
+
+// The last total written, from the newest copy that is intact. Returns -1
+// when neither is, as in a new store.
+int storeLoad(Store *store, double *total) {
+   if (!store->loaded) return -1;
+   *total = store->total;
+   return 0;
+}
+
+// Take a new total, it is written out once the sync interval has passed since
+// the last write
+void storeSet(Store *store, double total) {
+   struct timespec now;
+
+   if (total != store->total) {
+      store->total = total;
+      store->dirty = 1;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (store->dirty && now.tv_sec - store->last_sync.tv_sec >= store->sync_interval) storeSync(store);
+}
+
+// Write the total out now if it has changed, over the older copy. Returns -1
+// if it could not be written, it is tried again on the next sync.
+int storeSync(Store *store) {
+   StoreRecord rec;
+
+   if (!store->dirty) return 0;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.magic = STORE_MAGIC;
+   rec.seq = store->seq + 1;
+   rec.total = store->total;
+   rec.time = time(0);
+   rec.crc = storeCrc(&rec.seq, sizeof(rec) - offsetof(StoreRecord, seq));
+
+   memcpy(store->map + (rec.seq & 1) * STORE_SLOT, &rec, sizeof(rec));
+   if (msync(store->map, STORE_SIZE, MS_SYNC) == -1) {
+      fprintf(stderr, "Error: could not write %s: %s\n", store->name, strerror(errno));
+      fflush(stderr);
+      return -1;
+   }
+   store->seq = rec.seq;
+   store->dirty = 0;
+   clock_gettime(CLOCK_MONOTONIC, &store->last_sync);
+   return 0;
+}
+
+// Write out whatever is still in memory and close the store
+void storeClose(Store *store) {
+   storeSync(store);
+   munmap(store->map, STORE_SIZE);
+   close(store->fd);
+   free(store);
+}
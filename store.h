@@ -0,0 +1,16 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+
+// seconds a changed total may wait in memory before it is written out, what a
+// power cut can lose against how often the SD card is written
+#define STORE_SYNC_INTERVAL  300
+
+typedef struct Store Store;
+
+Store *storeOpen(const char *file, int sync_interval);
+int storeLoad(Store *store, double *total);
+void storeSet(Store *store, double total);
+int storeSync(Store *store);
+void storeClose(Store *store);
+
+#endif // _STORE_H_
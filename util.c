@@ -20,6 +20,7 @@ void waitTime(size_t msec)
 // quit
 void quit_imgproc()
 {
+	imgPoolDrain();
 	SDL_Quit();
 }
 
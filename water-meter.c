@@ -3,6 +3,15 @@
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <linux/videodev2.h>
 
 //#define USE_MQTT
 #ifndef bool
@@ -10,271 +19,754 @@ typedef unsigned char bool;
 #define true  1
 #define false 0
 #endif
-#include <imgproc.h>
+#include <meter.h>
+#include <ring.h>
+#include <publisher.h>
+#include <store.h>
+#include <history.h>
+#include <latency.h>
+#include <metrics.h>
+
+// running totals, WATER_METER_TOTAL_FILE is the plain text file of older
+// versions, only read when there is no store yet
+#define WATER_METER_TOTAL_FILE   "/home/pi/logs/water-meter-total"
+#define WATER_METER_STORE_SUFFIX ".rec"
+// litres of every second water flowed, read with water-meter-query
+#define WATER_METER_HISTORY_FILE "/home/pi/logs/water-meter-history"
+// readings wait here while the broker is unreachable
+#define WATER_METER_SPOOL_FILE   "/home/pi/logs/water-meter-spool"
+
+// cameras, each watching its own meter, served by one process
+#define MAX_FEEDS           8
+// seconds between rollups of the accumulated values, on the wall clock's minutes
+#define ROLLUP_INTERVAL    60
+// seconds between dumps of the stage latencies, on the wall clock's hours.
+// SIGUSR1 dumps them at any time.
+#define LATENCY_DUMP_INTERVAL  3600
+// frame rate of a camera whose meter is moving, idle ones drop to METER_IDLE_FPS
+#define CAPTURE_FPS        30
+
+// one camera and the meter it watches
+typedef struct {
+   Meter *meter;
+   Camera *cam;
+   Recorder *rec;
+
+   // options
+   char *name;
+   char *device;              // capture device, or the recording with replay set
+   bool replay;
+   char *record_file;
+   char *store_name;          // store asked for, the only one a replay writes
+   char *history_name;        // likewise the history
+   unsigned int width, height; // capture size asked for
+   bool mjpeg;                // capture MJPEG where the camera has it
+   unsigned int org_x, org_y, org_r;
+   unsigned int regions;
+   unsigned int max_flow;     // l/min, sets the idle frame rate
+   double start_value;
+   char total_file[256];
+   char store_file[256 + sizeof(WATER_METER_STORE_SUFFIX)];
+   Store *store;              // running total, owned by the output thread
+   char history_file[256];
+   History *history;          // flow history, owned by the analysis thread
+   time_t replay_start;       // wall clock the first replayed frame stands for
+
+   // capture thread state
+   bool ended;
+   unsigned long frames;      // the counters are stored atomically for the metrics
+   unsigned long idle_skipped;
+   unsigned int fps;          // rate asked for
+   double last_stamp;         // capture time of the last frame passed on
+   unsigned int skipped;      // frames left out since then
+   MotionGate gate;
+
+   // set by the analysis thread, read by the capture thread and the metrics
+   int idle;
+   unsigned long analysed;
+   double total;              // with the start value
+   double flow;
+   double last_minute;
+   char labels[256];          // Prometheus labels naming the feed
+
+   // output thread state, the values last published
+   double published_last_minute;
+   double published_last_10minute;
+   double published_last_drain;
+   double published_total;
+} Feed;
+
+static Feed feeds[MAX_FEEDS];
+static unsigned int n_feeds = 0;
+
+Viewer *view = NULL;
 #ifdef USE_MQTT
-#include <mosquitto.h>
+Publisher *pub = NULL;
 #endif
 
-#define NUM_REGIONS      8
-#define IMAGE_WIDTH    176
-#define IMAGE_HEIGHT   144
-#define RGN_WIDTH       10
-#define RGN_HEIGHT      10
-#define WATER_METER_TOTAL_FILE   "/home/pi/logs/water-meter-total"
+// capture -> analysis -> output pipeline. Decoded frames of every camera go
+// from the capture thread to the analysis thread, frames to show and values to
+// publish go on to the output thread, which is the main thread as it owns the
+// display.
+#define FRAME_RING_SIZE     4
+#define DISPLAY_RING_SIZE   2
+#define PUBLISH_RING_SIZE  64
+
+typedef struct {
+   Feed *feed;
+   Image *img;            // owned by whoever pops the message, NULL for a rollup
+   time_t rollup;         // end of the minute to roll up
+   unsigned int sequence; // the camera's frame number
+   double stamp;          // capture time, seconds
+   unsigned int skipped;  // frames left out before this one, idle or unchanged
+   long long captured;    // latNow when it was taken off the camera
+   Image *view;           // the whole frame in colour for the viewer or NULL, owned likewise
+} FrameMsg;
+
+typedef struct {
+   Image *img;            // owned by whoever pops the message
+   int region;            // region hit in this frame, or -1
+} DisplayMsg;
+
+typedef struct {
+   Feed *feed;
+   time_t time;
+   double last_minute;
+   double last_10minute;
+   double last_drain;
+   double total;
+} PublishMsg;
+
+static Ring *frame_ring   = NULL;
+static Ring *display_ring = NULL;
+static Ring *publish_ring = NULL;
+
+static bool display_image = false;
+static bool use_angle = false;
+static bool adaptive_rate = true;
+static bool motion_gate = true;
+static unsigned long frames = 0;
+static unsigned long skipped = 0;
+static Metrics *metrics = NULL;
 
-typedef struct _REGION {
-   unsigned int x, y;
-   unsigned int w, h;
-} REGION;
+#ifdef USE_MQTT
+// topic for one of a feed's values, the default meter keeps the original names
+static void feedTopic(char *topic, size_t size, const Feed *feed, const char *value) {
+   char name[PUB_TOPIC_MAX] = "";
+   unsigned int i;
 
-#define ORG_X 67
-#define ORG_Y 45
-#define ORG_R 30
-#define DX    21 // (unsigned int)(ORG_R*0.71)
-#define DY    21 // (unsigned int)(ORG_R*0.71)
+   if (*feed->name) {
+      name[0] = '_';
+      for (i = 0; feed->name[i] && i + 2 < sizeof(name); i++) {
+         name[i + 1] = toupper((unsigned char)feed->name[i]);
+      }
+      name[i + 1] = '\0';
+   }
+   snprintf(topic, size, "/lusa/misc-1/WATER_METER%s_%s/status", name, value);
+}
+#endif
 
-//unsigned int xDiv[5] = { 40, 45, 67, 90, 95 };
-//unsigned int yDiv[5] = { 15, 25, 45, 65, 75 };
-const unsigned int xDiv[5] = { ORG_X-ORG_R, ORG_X-DX, ORG_X, ORG_X+DX, ORG_X+ORG_R };
-const unsigned int yDiv[5] = { ORG_Y-ORG_R, ORG_Y-DY, ORG_Y, ORG_Y+DY, ORG_Y+ORG_R };
+// queue values for the broker, runs on the output thread
+static void sendValues(const PublishMsg *values) {
+#ifdef USE_MQTT
+   Feed   *feed         = values->feed;
+   time_t time          = values->time;
+   double last_minute   = values->last_minute;
+   double last_10minute = values->last_10minute;
+   double last_drain    = values->last_drain;
+   double total         = values->total;
+
+   char last_minute_topic[PUB_TOPIC_MAX];
+   char last_10minute_topic[PUB_TOPIC_MAX];
+   char last_drain_topic[PUB_TOPIC_MAX];
+   char total_topic[PUB_TOPIC_MAX];
+   char *payload_format      = "{\"type\":\"METER_VALUE\",\"update_time\":%llu,\"value\":%.2f,\"unit\":\"%s\"}";
 
-REGION region[NUM_REGIONS] =
-{
-   {ORG_X-DX,     ORG_Y+DY,     RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X-ORG_R,  ORG_Y,        RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X-DX,     ORG_Y-DY,     RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X,        ORG_Y-ORG_R,  RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X+DX,     ORG_Y-DY,     RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X+ORG_R,  ORG_Y,        RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X+DX,     ORG_Y+DY,     RGN_WIDTH, RGN_HEIGHT},
-   {ORG_X,        ORG_Y+ORG_R,  RGN_WIDTH, RGN_HEIGHT}
-};
+   char payload[200];
 
-Viewer *view = NULL;
-Camera *cam  = NULL;
-#ifdef USE_MQTT
-struct mosquitto *mosq = NULL;
-#endif
-double meter_start_value = 0.0;
+   feedTopic(last_minute_topic, sizeof(last_minute_topic), feed, "FLOW");
+   feedTopic(last_10minute_topic, sizeof(last_10minute_topic), feed, "10MIN");
+   feedTopic(last_drain_topic, sizeof(last_drain_topic), feed, "DRAIN");
+   feedTopic(total_topic, sizeof(total_topic), feed, "TOTAL");
 
-static int regionHit(Image *img) {
+   if (pub) {
+      if (last_minute != feed->published_last_minute) {
+         sprintf(payload, payload_format, (long long)time*1000, last_minute, "l/m");
+         pubQueue(pub, last_minute_topic, payload);
+         feed->published_last_minute = last_minute;
+      }
+      if (last_10minute != feed->published_last_10minute) {
+         sprintf(payload, payload_format, (long long)time*1000, last_10minute, "l/10m");
+         pubQueue(pub, last_10minute_topic, payload);
+         feed->published_last_10minute = last_10minute;
+      }
 
-   unsigned int i;
-   unsigned int x, y;
-   unsigned int rx, ry, rw, rh;
-   unsigned int count_dark;
-   unsigned char red;
-   unsigned char green;
-   unsigned char blue;
-   unsigned char *pixel;
-
-   for (i = 0; i < NUM_REGIONS; i++) {
-      count_dark = 0;
-      rx = region[i].x;
-      ry = region[i].y;
-      rw = region[i].w;
-      rh = region[i].h;
-
-      // Count number of dark pixels in given region
-      for (x = rx; x < rx + rw; x++) {
-         for (y = ry; y < ry + rh; y++) {
-            // Get a pointer to the current pixel
-            pixel = (unsigned char *)imgGetPixel(img, x, y);
-
-            // index 0 is blue, 1 is green and 2 is red
-            red = pixel[2];
-            green = pixel[1];
-            blue = pixel[0];
-
-            // check if pixel is dark
-            if (red < 128 || green < 128 || blue < 128){
-               count_dark++;
-            }
-         }
+      if (last_drain != feed->published_last_drain && last_drain > 0.0) {
+         sprintf(payload, payload_format, (long long)time*1000, last_drain, "l");
+         pubQueue(pub, last_drain_topic, payload);
+         feed->published_last_drain = last_drain;
       }
 
-      // We have a hit if more than 80% of the pixels is dark
-      if (count_dark > (rw * rh) * 0.8){
-         return i;
+      if (total != feed->published_total) {
+         sprintf(payload, payload_format, (long long)time*1000, total + feed->meter->start_value, "l");
+         pubQueue(pub, total_topic, payload);
+         feed->published_total = total;
       }
    }
+   else
+#endif
+   {
+      fprintf(stderr, "Error: mosq\n");
+      fflush(stderr);
+   }
 
-   return -1;
+   // the store writes the total out once per sync interval at most
+   if (values->feed->store) storeSet(values->feed->store, values->total + values->feed->meter->start_value);
 }
 
-static void drawRegion(Image *img, REGION region, unsigned char red, unsigned char green, unsigned char blue) {
-
-   unsigned int x, y;
-   unsigned int rx, ry, rw, rh;
+// called by meterRollup on the analysis thread, the values are sent from
+// the output thread so a slow broker never holds up the analysis
+void publishValues(Meter *m, time_t time, double last_minute, double last_10minute, double last_drain,
+                   double total) {
+   PublishMsg values = { NULL, time, last_minute, last_10minute, last_drain, total };
+   unsigned int i;
 
-   rx = region.x;
-   ry = region.y;
-   rw = region.w;
-   rh = region.h;
+   for (i = 0; i < n_feeds; i++) {
+      if (feeds[i].meter == m) values.feed = &feeds[i];
+   }
+   if (ringPush(publish_ring, &values) != 0) {
+      fprintf(stderr, "Error: publish queue full, values dropped\n");
+      fflush(stderr);
+   }
+}
 
-   y = ry;
-   for (x = rx; x < rx + rw; x++) imgSetPixel(img, x, y, blue, green, red);
-   y = ry + rh;
-   for (x = rx; x < rx + rw; x++) imgSetPixel(img, x, y, blue, green, red);
-   x = rx;
-   for (y = ry; y < ry + rh; y++) imgSetPixel(img, x, y, blue, green, red);
-   x = rx + rw;
-   for (y = ry; y < ry + rh; y++) imgSetPixel(img, x, y, blue, green, red);
+// frame counters of every stage of the pipeline
+static void reportPipeline(void) {
+   RingStats f, d, p;
+
+   ringStats(frame_ring, &f);
+   ringStats(display_ring, &d);
+   ringStats(publish_ring, &p);
+   fprintf(stdout, "Pipeline: %lu frames captured, %lu analysed, %lu dropped, %lu stalls; "
+           "%lu displayed, %lu skipped; %lu published, %lu dropped\n",
+           frames, f.pushed, f.dropped, f.stalls, d.pushed, d.dropped, p.pushed, p.dropped);
+   fflush(stdout);
 }
-void doPublish(char *topic, char *payload) {
-#ifdef USE_MQTT
-   int i;
-   int  rc;
 
-   for (i = 0; i < 10; i++) {
-      rc = mosquitto_publish(mosq, NULL, topic, strlen(payload), payload, 0, true);
-      if (rc != MOSQ_ERR_SUCCESS) {
-         fprintf(stderr, "Error: mosquitto_publish %d. Try to reconnect.\n", rc);
-         fflush(stderr);
-         rc = mosquitto_reconnect(mosq);
-         if (rc != MOSQ_ERR_SUCCESS) {
-            fprintf(stderr, "Error: mosquitto_reconnect %d. Failed to reconnect.\n", rc);
-            fflush(stderr);
-         }
-      }
-      else {
-         mosquitto_loop(mosq, 0, 1);
-         return;
+#define LOAD(var)  __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+// the page Prometheus scrapes, runs on the metrics thread so everything is
+// read from counters stored atomically and the meters are left alone
+static void writeMetrics(FILE *fp) {
+   const char *rings[3] = { "frame", "display", "publish" };
+   RingStats rs[3];
+   unsigned int i, r;
+
+   metHeader(fp, "water_meter_frames_captured_total", "counter", "Frames taken off the camera.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_frames_captured_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].frames));
+   }
+   metHeader(fp, "water_meter_frames_analysed_total", "counter", "Frames the meter was updated with.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_frames_analysed_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].analysed));
+   }
+   metHeader(fp, "water_meter_frames_dropped_total", "counter", "Frames missing from the camera's sequence.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_frames_dropped_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].meter->dropped_total));
+   }
+   metHeader(fp, "water_meter_frames_idle_skipped_total", "counter", "Frames left out while the meter was idle.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_frames_idle_skipped_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].idle_skipped));
+   }
+   metHeader(fp, "water_meter_frames_gated_total", "counter", "Frames the motion gate found unchanged.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_frames_gated_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].gate.gated));
+   }
+   metHeader(fp, "water_meter_camera_recoveries_total", "counter", "Times the camera was lost and came back.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_camera_recoveries_total{%s} %lu\n", feeds[i].labels, LOAD(feeds[i].cam->recoveries));
+   }
+   metHeader(fp, "water_meter_region_hits_total", "counter", "Needle transitions into each region.");
+   for (i = 0; i < n_feeds; i++) {
+      for (r = 0; r < feeds[i].meter->num_regions; r++) {
+         fprintf(fp, "water_meter_region_hits_total{%s,region=\"%u\"} %lu\n", feeds[i].labels, r,
+                 LOAD(feeds[i].meter->region_hits[r]));
       }
    }
+
+   metHeader(fp, "water_meter_total_litres", "gauge", "Meter reading.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_total_litres{%s} %.3f\n", feeds[i].labels, metGet(&feeds[i].total));
+   }
+   metHeader(fp, "water_meter_flow_litres_per_minute", "gauge", "Flow between the last two transitions.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_flow_litres_per_minute{%s} %.3f\n", feeds[i].labels, metGet(&feeds[i].flow));
+   }
+   metHeader(fp, "water_meter_minute_litres", "gauge", "Litres so far this minute.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_minute_litres{%s} %.3f\n", feeds[i].labels, metGet(&feeds[i].last_minute));
+   }
+   metHeader(fp, "water_meter_idle", "gauge", "1 while the meter stands still and is captured at the idle rate.");
+   for (i = 0; i < n_feeds; i++) {
+      fprintf(fp, "water_meter_idle{%s} %d\n", feeds[i].labels, LOAD(feeds[i].idle));
+   }
+
+   ringStats(frame_ring, &rs[0]);
+   ringStats(display_ring, &rs[1]);
+   ringStats(publish_ring, &rs[2]);
+   metHeader(fp, "water_meter_ring_pushed_total", "counter", "Messages passed on between the pipeline threads.");
+   for (r = 0; r < 3; r++) fprintf(fp, "water_meter_ring_pushed_total{ring=\"%s\"} %lu\n", rings[r], rs[r].pushed);
+   metHeader(fp, "water_meter_ring_dropped_total", "counter", "Messages dropped as the next thread was behind.");
+   for (r = 0; r < 3; r++) fprintf(fp, "water_meter_ring_dropped_total{ring=\"%s\"} %lu\n", rings[r], rs[r].dropped);
+   metHeader(fp, "water_meter_ring_stalls_total", "counter", "Pushes that had to wait for room.");
+   for (r = 0; r < 3; r++) fprintf(fp, "water_meter_ring_stalls_total{ring=\"%s\"} %lu\n", rings[r], rs[r].stalls);
+   metHeader(fp, "water_meter_ring_high_water", "gauge", "Most messages ever waiting.");
+   for (r = 0; r < 3; r++) fprintf(fp, "water_meter_ring_high_water{ring=\"%s\"} %u\n", rings[r], rs[r].high_water);
+
+#ifdef USE_MQTT
+   PubStats ps;
+
+   pubStats(pub, &ps);
+   metHeader(fp, "water_meter_publish_queued_total", "counter", "Readings queued for the broker.");
+   fprintf(fp, "water_meter_publish_queued_total %lu\n", ps.queued);
+   metHeader(fp, "water_meter_publish_sent_total", "counter", "Readings acknowledged by the broker.");
+   fprintf(fp, "water_meter_publish_sent_total %lu\n", ps.sent);
+   metHeader(fp, "water_meter_publish_retried_total", "counter", "Readings sent again as they were not acknowledged in time.");
+   fprintf(fp, "water_meter_publish_retried_total %lu\n", ps.retried);
+   metHeader(fp, "water_meter_publish_failed_total", "counter", "Batches mosquitto would not send.");
+   fprintf(fp, "water_meter_publish_failed_total %lu\n", ps.failed);
+   metHeader(fp, "water_meter_publish_spooled_total", "counter", "Readings written to the spool.");
+   fprintf(fp, "water_meter_publish_spooled_total %lu\n", ps.spooled);
+   metHeader(fp, "water_meter_publish_lost_total", "counter", "Readings neither queued nor spooled.");
+   fprintf(fp, "water_meter_publish_lost_total %lu\n", ps.lost);
+   metHeader(fp, "water_meter_publish_backlog_bytes", "gauge", "Spool still to be sent.");
+   fprintf(fp, "water_meter_publish_backlog_bytes %lu\n", ps.backlog);
+   metHeader(fp, "water_meter_publish_connected", "gauge", "1 while connected to the broker.");
+   fprintf(fp, "water_meter_publish_connected %d\n", ps.connected);
 #endif
+
+   latExport(fp, "water_meter_stage_seconds");
 }
 
-void publishValues(time_t time, double last_minute, double last_10minute, double last_drain,
-                   double total) {
-#ifdef USE_MQTT
-   char *last_minute_topic   = "/lusa/misc-1/WATER_METER_FLOW/status";
-   char *last_10minute_topic = "/lusa/misc-1/WATER_METER_10MIN/status";
-   char *last_drain_topic    = "/lusa/misc-1/WATER_METER_DRAIN/status";
-   char *total_topic         = "/lusa/misc-1/WATER_METER_TOTAL/status";
-   char *payload_format      = "{\"type\":\"METER_VALUE\",\"update_time\":%llu,\"value\":%.2f,\"unit\":\"%s\"}";
+// capture at the idle rate while the feed's meter stands still and at full
+// rate as soon as it moves. Cameras that cannot change rate keep theirs, the
+// frames beyond the rate asked for are skipped instead.
+static void adaptRate(Feed *feed) {
+   unsigned int fps = __atomic_load_n(&feed->idle, __ATOMIC_RELAXED) ? METER_IDLE_FPS(feed->max_flow) : CAPTURE_FPS;
 
-   char payload[200];
-   static double published_last_minute   = -1.0;
-   static double published_last_10minute = -1.0;
-   static double published_last_drain    = -1.0;
-   static double published_total         = -1.0;
+   if (fps != feed->fps) {
+      feed->fps = fps;
+      camSetFrameRate(feed->cam, fps);
+   }
+}
 
-   if (mosq) {
-      if (last_minute != published_last_minute) {
-         sprintf(payload, payload_format, (long long)time*1000, last_minute, "l/m");
-         doPublish(last_minute_topic, payload);
-         published_last_minute = last_minute;
+// take one frame off a feed's camera if there is one, decode what the
+// analysis needs and pass it on. Returns -1 once the camera has no more.
+static int captureFrame(Feed *feed) {
+   Frame frame;
+   Image *img;
+   FrameMsg msg = { feed, NULL, 0, 0, 0.0, 0, 0, NULL };
+   long long t;
+
+   if (adaptive_rate) adaptRate(feed);
+
+   t = latNow();
+   int r = camTryBorrowFrame(feed->cam, &frame);
+   if (r != 0) return r;
+   t = msg.captured = latRecord(LAT_DQBUF, t);
+
+   msg.sequence = frame.sequence;
+   msg.stamp = frame.timestamp.tv_sec + frame.timestamp.tv_usec / 1e6;
+
+   frames++;
+   __atomic_store_n(&feed->frames, feed->frames + 1, __ATOMIC_RELAXED);
+   if (feed->rec) recWriteFrame(feed->rec, &frame);
+
+   // frames come faster than the rate asked for when the camera could not be
+   // slowed down, a little early is still on time
+   if (feed->fps < CAPTURE_FPS && msg.stamp - feed->last_stamp < 0.9 / feed->fps) {
+      feed->skipped++;
+      skipped++;
+      __atomic_store_n(&feed->idle_skipped, feed->idle_skipped + 1, __ATOMIC_RELAXED);
+      camReleaseFrame(feed->cam, &frame);
+      return 0;
+   }
+   feed->last_stamp = msg.stamp;
+
+   // nor are frames that look like the last one analysed worth converting
+   if (motion_gate) {
+      t = latNow();
+      int pass = gatePass(&feed->gate, &frame, msg.stamp);
+      latRecord(LAT_GATE, t);
+      if (!pass) {
+         feed->skipped++;
+         camReleaseFrame(feed->cam, &frame);
+         return 0;
       }
-      if (last_10minute != published_last_10minute) {
-         sprintf(payload, payload_format, (long long)time*1000, last_10minute, "l/10m");
-         doPublish(last_10minute_topic, payload);
-         published_last_10minute = last_10minute;
+   }
+   msg.skipped = feed->skipped;
+   feed->skipped = 0;
+
+   // the analysis only looks at the luma of the regions, colour is only
+   // decoded for the viewer, which shows the first feed
+   img = imgNewFormat(camGetWidth(feed->cam), camGetHeight(feed->cam), IMG_LUMA);
+   if (img) {
+      int decoded;
+
+      t = latNow();
+      if (use_angle) {
+         decoded = frmToImageRects(&frame, img, &feed->meter->dial_box, 1);
+      } else {
+         unsigned int n_rects;
+         const Rect *rects = regionDecodeRects(feed->meter, &n_rects);
+         decoded = frmToImageRects(&frame, img, rects, n_rects);
       }
+      latRecord(LAT_CONVERT, t);
 
-      if (last_drain != published_last_drain && last_drain > 0.0) {
-         sprintf(payload, payload_format, (long long)time*1000, last_drain, "l");
-         doPublish(last_drain_topic, payload);
-         published_last_drain = last_drain;
+      // a corrupt MJPEG frame is left out like an unchanged one
+      if (decoded != 0) {
+         imgDestroy(img);
+         img = NULL;
+         feed->skipped += msg.skipped + 1;
+      }
+   }
+   if (img && display_image && feed == &feeds[0]) {
+      msg.view = imgNew(camGetWidth(feed->cam), camGetHeight(feed->cam));
+      if (msg.view && frmToImage(&frame, msg.view) != 0) {
+         imgDestroy(msg.view);
+         msg.view = NULL;
       }
+   }
+   camReleaseFrame(feed->cam, &frame);
+
+   msg.img = img;
+   if (img && ringPush(frame_ring, &msg) != 0) {
+      imgDestroy(img);
+      if (msg.view) imgDestroy(msg.view);
+      feed->skipped += msg.skipped;
+   }
+   return 0;
+}
 
-      if (total != published_total) {
-         sprintf(payload, payload_format, (long long)time*1000, total + meter_start_value, "l");
-         doPublish(total_topic, payload);
-         published_total = total;
+// arm the rollup timer at the next whole minute of the wall clock. The timer
+// is cancelled when the clock is set, so it can be aligned again.
+static int armRollup(int fd) {
+   struct itimerspec its;
+   time_t now = time(0);
 
-         FILE *fp = fopen(WATER_METER_TOTAL_FILE, "w+");
-         if (fp) {
-            fprintf(fp, "%8.2f", total + meter_start_value);
-            fclose(fp);
-         }
-      }
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_sec = (now / ROLLUP_INTERVAL + 1) * ROLLUP_INTERVAL;
+   its.it_interval.tv_sec = ROLLUP_INTERVAL;
+   return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
 
-      mosquitto_loop(mosq, 0, 1);
+// rollup time at the minute the timer went off, or 0 if it did not
+static time_t readRollup(int fd) {
+   uint64_t expired;
+   struct timespec now;
+
+   if (read(fd, &expired, sizeof(expired)) != sizeof(expired)) {
+      // the clock was set, as it is when the time is first synchronised after boot
+      if (errno == ECANCELED) armRollup(fd);
+      return 0;
    }
-   else
-#endif
-   {
-      fprintf(stderr, "Error: mosq\n");
+   // the nearest minute, the timer may be read a little either side of it;
+   // minutes missed while suspended are rolled into this one
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (now.tv_sec + ROLLUP_INTERVAL / 2) / ROLLUP_INTERVAL * ROLLUP_INTERVAL;
+}
+
+// capture thread: the event loop. Waits on every camera at once and takes
+// frames off them as soon as they arrive, on the rollup timer, and on the stop
+// and dump signals. It never waits on the rest of the pipeline unless the frame ring
+// blocks.
+static void *captureThread(void *arg) {
+   struct epoll_event events[MAX_FEEDS + 2];
+   struct epoll_event ev;
+   unsigned int running = 0;
+   unsigned int i;
+   bool   stop = false;
+   time_t rollup = 0;
+   long long t;
+   struct signalfd_siginfo si;
+   sigset_t stop_signals;
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+   int rollup_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+   int signal_fd;
+
+   sigemptyset(&stop_signals);
+   sigaddset(&stop_signals, SIGINT);
+   sigaddset(&stop_signals, SIGTERM);
+   sigaddset(&stop_signals, SIGUSR1);
+   signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+   for (i = 0; i < n_feeds; i++) {
+      ev.events = EPOLLIN;
+      ev.data.ptr = &feeds[i];
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, camGetFd(feeds[i].cam), &ev) == 0) {
+         running++;
+      } else {
+         fprintf(stderr, "%s: epoll error %d, %s\n", feeds[i].device, errno, strerror(errno));
+         feeds[i].ended = true;
+      }
+   }
+   ev.events = EPOLLIN;
+   ev.data.ptr = &rollup_fd;
+   if (rollup_fd == -1 || armRollup(rollup_fd) != 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, rollup_fd, &ev) != 0) {
+      fprintf(stderr, "Rollup timer error %d, %s\n", errno, strerror(errno));
       fflush(stderr);
+      exit(EXIT_FAILURE);
+   }
+   ev.data.ptr = &signal_fd;
+   if (signal_fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, signal_fd, &ev) != 0) {
+      fprintf(stderr, "Signal handling error %d, %s\n", errno, strerror(errno));
+      fflush(stderr);
+      exit(EXIT_FAILURE);
    }
-}
 
-void updateValues(int new_region_number) {
+   while (!stop && running > 0) {
+      t = latNow();
+      int n = epoll_wait(epfd, events, MAX_FEEDS + 2, 1000);
+      latRecord(LAT_WAIT, t);
+      if (n == -1 && errno != EINTR) {
+         fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+         break;
+      }
 
-   static time_t last_update_time = 0;
-   static time_t last_update_10time = 0;
-   static int last_region_number = -1;
+      // one frame per ready camera, so a busy one cannot starve the others
+      for (i = 0; i < (unsigned int)n; i++) {
+         if (events[i].data.ptr == &rollup_fd) {
+            time_t due = readRollup(rollup_fd);
+            if (due) rollup = due;
+            if (due && due % LATENCY_DUMP_INTERVAL == 0) latDump(stdout);
+            continue;
+         }
+         // stop, so recordings are closed and the spool is written properly
+         if (events[i].data.ptr == &signal_fd) {
+            while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+               if (si.ssi_signo == SIGUSR1) latDump(stdout);
+               else stop = true;
+            }
+            continue;
+         }
 
-   static int    frame_rate = 0;
-   static double total = 0.0;
-   static double last_drain = 0.0;
-   static double last_minute = 0.0;
-   static double last_10minute = 0.0;
+         Feed *feed = events[i].data.ptr;
 
-   int    elapsed_regions;
-   time_t new_time = time(0);
+         // a replay ends when the recording does
+         if (captureFrame(feed) == -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, camGetFd(feed->cam), NULL);
+            feed->ended = true;
+            running--;
+         }
+      }
 
-   struct tm *tmptr = localtime(&new_time);
-   char time_str[20];
-   strftime(time_str, sizeof(time_str), "%H:%M:%S", tmptr);
+      // the rollup follows the frames of its minute down the frame ring, and
+      // is tried again until there is room for it
+      if (rollup) {
+         FrameMsg msg = { NULL, NULL, rollup, 0, 0.0, 0, 0, NULL };
+         if (ringPush(frame_ring, &msg) == 0) rollup = 0;
+      }
 
-   if (last_update_time == 0) last_update_time = new_time;
-   if (last_update_10time == 0) last_update_10time = new_time;
+      // a camera that stops delivering is reset and opened again, the
+      // camera layer decides when and keeps trying until it is back
+      for (i = 0; i < n_feeds; i++) {
+         if (!feeds[i].ended) camPollOverdue(feeds[i].cam);
+      }
+   }
+   close(signal_fd);
+   close(rollup_fd);
+   close(epfd);
+   ringClose(frame_ring);
+   return NULL;
+}
 
-   if (new_region_number != -1 && last_region_number != -1 &&
-       new_region_number != last_region_number) {
-      fprintf(stdout, "%s - Hit region: %d [ +0.125 l ]\n", time_str, new_region_number);
-      fflush(stdout);
+// the values of a feed's meter the metrics show, runs on the analysis thread
+static void feedValues(Feed *feed) {
+   Meter *m = feed->meter;
 
-      elapsed_regions = new_region_number - last_region_number;
-      if (elapsed_regions < 0) elapsed_regions += NUM_REGIONS;
+   metSet(&feed->total, m->total + m->start_value);
+   metSet(&feed->flow, m->flow);
+   metSet(&feed->last_minute, m->last_minute);
+}
 
-      total         += (elapsed_regions * 1.0 / NUM_REGIONS);
-      last_minute   += (elapsed_regions * 1.0 / NUM_REGIONS);
-      last_10minute += (elapsed_regions * 1.0 / NUM_REGIONS);
-      last_drain    += (elapsed_regions * 1.0 / NUM_REGIONS);
+// analysis thread: score the regions and update the accumulated values of
+// whichever meter the frame belongs to, and roll up the values of every meter
+// when a minute has passed
+static void *analysisThread(void *arg) {
+   FrameMsg msg;
+   RegionScores scores;
+   double angle = -1.0;
+   unsigned int i;
+   long long t;
+
+   while (ringWait(frame_ring, -1) >= 0) {
+      while (ringPop(frame_ring, &msg) == 0) {
+         if (!msg.img) {
+            for (i = 0; i < n_feeds; i++) {
+               meterRollup(feeds[i].meter, msg.rollup);
+               feedValues(&feeds[i]);
+               if (feeds[i].history) histFlush(feeds[i].history);
+            }
+            continue;
+         }
+         Meter *m = msg.feed->meter;
+         double total = m->total;
+
+         t = latNow();
+         regionScores(m, msg.img, &scores);
+         t = latRecord(LAT_REGIONS, t);
+         if (use_angle) {
+            angle = needleAngle(m, msg.img);
+            t = latRecord(LAT_ANGLE, t);
+         }
 
+         meterSkipped(m, msg.skipped);
+         DisplayMsg shown = { msg.view, updateValues(m, &scores, angle, msg.sequence, msg.stamp) };
+         latRecord(LAT_UPDATE, t);
+         latRecord(LAT_FRAME, msg.captured);
+         __atomic_store_n(&msg.feed->idle, m->idle, __ATOMIC_RELAXED);
+         __atomic_store_n(&msg.feed->analysed, msg.feed->analysed + 1, __ATOMIC_RELAXED);
+         feedValues(msg.feed);
+
+         // the clock is only read while water flows. A replay's frames are
+         // stamped from its first, its flow goes where the recording puts it
+         // after the replay started however fast it runs.
+         if (m->total != total && msg.feed->history) {
+            time_t when = msg.feed->replay ? msg.feed->replay_start + (time_t)msg.stamp : time(0);
+            histAdd(msg.feed->history, when, m->total - total);
+         }
+         imgDestroy(msg.img);
+         if (msg.view && ringPush(display_ring, &shown) != 0) imgDestroy(msg.view);
+      }
    }
-   if (new_time >= last_update_time + 60) {
+   ringClose(display_ring);
+   ringClose(publish_ring);
+   return NULL;
+}
 
-      publishValues(new_time, last_minute, last_10minute, last_drain, total);
+static void showFrame(DisplayMsg *shown) {
+   Meter *m = feeds[0].meter;
+   int i;
 
+   for (i = 0; i < m->num_regions; i++) {
 
-      fprintf(stdout, "%s - Last minute: %6.2f l, Last 10min: %6.2f l, Last drain: %6.2f l, Total: %8.2f l, Framerate: %d\n",
-              time_str, last_minute, last_10minute, last_drain, total + meter_start_value, frame_rate/60);
-      fflush(stdout);
+      unsigned char red = 0;
+      unsigned char green= 255;
+      unsigned char blue = 0;
 
-      if (last_minute == 0.0) last_drain = 0.0;
-      last_minute = 0.0;
-      last_update_time = new_time;
-      frame_rate = 0;
+      if (i == shown->region) {
+         red = 255;
+         green = 0;
+         blue = 0;
+      }
+      drawRegion(shown->img, m->region[i], red, green, blue);
    }
-   if (new_time >= last_update_10time + 10*60) {
-      last_10minute = 0.0;
-      last_update_10time = new_time;
+   // display the image to view the changes
+   viewDisplayImage(view, shown->img);
+   imgDestroy(shown->img);
+}
+
+// output thread: publish and display until the analysis is done
+static void runOutput(void) {
+   struct pollfd fds[2] = {
+      { ringFd(display_ring), POLLIN, 0 },
+      { ringFd(publish_ring), POLLIN, 0 }
+   };
+   unsigned long reported_drops = 0;
+   DisplayMsg shown;
+   PublishMsg values;
+   RingStats f, d, p;
+
+   while (1) {
+      int done = ringClosed(display_ring) && ringClosed(publish_ring);
+
+      ringAck(display_ring);
+      ringAck(publish_ring);
+      while (ringPop(publish_ring, &values) == 0) {
+         long long t = latNow();
+         sendValues(&values);
+         latRecord(LAT_PUBLISH, t);
+
+         // say so when frames have been lost since the last report
+         ringStats(frame_ring, &f);
+         ringStats(display_ring, &d);
+         ringStats(publish_ring, &p);
+         if (f.dropped + d.dropped + p.dropped != reported_drops) {
+            reportPipeline();
+            reported_drops = f.dropped + d.dropped + p.dropped;
+         }
+      }
+      while (ringPop(display_ring, &shown) == 0) {
+         long long t = latNow();
+         showFrame(&shown);
+         latRecord(LAT_DISPLAY, t);
+      }
+
+      if (done) break;
+      poll(fds, 2, -1);
    }
-   if (new_region_number != -1) last_region_number = new_region_number;
-   frame_rate++;
 }
 
 static void cleanup(int sig, siginfo_t *siginfo, void *context) {
+   unsigned int i;
 
+   if (metrics) metClose(metrics);
    if (view) viewClose(view);
-   if (cam) camClose(cam);
+   for (i = 0; i < n_feeds; i++) {
+      if (feeds[i].cam) camClose(feeds[i].cam);
+      if (feeds[i].meter) meterFree(feeds[i].meter);
+      gateFree(&feeds[i].gate);
+
+      // a clean stop loses nothing of the total
+      if (feeds[i].store) storeClose(feeds[i].store);
+      if (feeds[i].history) histClose(feeds[i].history);
+   }
 
    // unintialise the library
    quit_imgproc();
 
 #ifdef USE_MQTT
-   // cleanup mosquitto connection
-   if (mosq) mosquitto_destroy(mosq);
-   mosquitto_lib_cleanup();
+   // whatever the broker has not acknowledged stays in the spool
+   if (pub) pubClose(pub);
 #endif
 
    exit(0);
 }
 
+// add a feed with the default dial geometry
+static Feed *newFeed(void) {
+   Feed *feed;
+
+   if (n_feeds == MAX_FEEDS) {
+      fprintf(stderr, "At most %d cameras\n", MAX_FEEDS);
+      fflush(stderr);
+      exit(1);
+   }
+   feed = &feeds[n_feeds++];
+   feed->name = "";
+   feed->width = IMAGE_WIDTH;
+   feed->height = IMAGE_HEIGHT;
+   feed->org_x = ORG_X;
+   feed->org_y = ORG_Y;
+   feed->org_r = ORG_R;
+   feed->regions = NUM_REGIONS;
+   feed->max_flow = METER_MAX_FLOW;
+   feed->fps = CAPTURE_FPS;
+   return feed;
+}
+
+// the feed options apply to, options given before any -dev or -replay go to
+// the first one
+static Feed *currentFeed(void) {
+   return n_feeds ? &feeds[n_feeds - 1] : newFeed();
+}
+
+// a -dev or -replay starts a new feed unless the current one has no camera yet
+static Feed *sourceFeed(void) {
+   Feed *feed = currentFeed();
+   return feed->device ? newFeed() : feed;
+}
+
 int main(int argc, char * argv[])
 {
    int    i;
@@ -282,10 +774,15 @@ int main(int argc, char * argv[])
    char   *host = "192.168.1.72";
    int    port = 1883;
    int    keepalive = 120;
-   bool   clean_session = true;
 #endif
-   int    new_region_number;
-   bool   display_image = false;
+   bool   replay_realtime = true;
+   bool   all_replays = true;
+   int    sync_interval = STORE_SYNC_INTERVAL;
+   int    metrics_port = METRICS_PORT;
+   sigset_t stop_signals;
+   pthread_t capture_thread, analysis_thread;
+   struct timespec start_time, end_time;
+   Feed   *feed;
 
 //   struct sigaction sa;
 
@@ -298,101 +795,302 @@ int main(int argc, char * argv[])
 //      return 1;
 //   }
 
-   // get start options
+   // get start options. Each -dev or -replay adds a camera, -name, -size,
+   // -mjpeg, -origin, -regions, -max_flow, -start_value, -store, -history
+   // and -record apply to the last one added.
    for (i = 0; i < argc; i++) {
       if (strcmp(argv[i], "-di") == 0) {
          display_image = true;
       }
+      if (strcmp(argv[i], "-dev") == 0) {
+         i++;
+         feed = sourceFeed();
+         feed->device = argv[i];
+         feed->replay = false;
+      }
+      if (strcmp(argv[i], "-name") == 0) {
+         i++;
+         currentFeed()->name = argv[i];
+      }
+      if (strcmp(argv[i], "-origin") == 0) {
+         i++;
+         feed = currentFeed();
+         if (sscanf(argv[i], "%u,%u,%u", &feed->org_x, &feed->org_y, &feed->org_r) != 3) {
+            fprintf(stderr, "-origin takes x,y,radius\n");
+            fflush(stderr);
+            return 1;
+         }
+      }
+      if (strcmp(argv[i], "-size") == 0) {
+         i++;
+         feed = currentFeed();
+         if (sscanf(argv[i], "%ux%u", &feed->width, &feed->height) != 2) {
+            fprintf(stderr, "-size takes widthxheight\n");
+            fflush(stderr);
+            return 1;
+         }
+      }
+      if (strcmp(argv[i], "-mjpeg") == 0) {
+         currentFeed()->mjpeg = true;
+      }
+      if (strcmp(argv[i], "-mjpeg_dc") == 0) {
+         frmJpegDcOnly(1);
+      }
+      if (strcmp(argv[i], "-regions") == 0) {
+         i++;
+         currentFeed()->regions = atoi(argv[i]);
+      }
+      if (strcmp(argv[i], "-max_flow") == 0) {
+         i++;
+         feed = currentFeed();
+         if (sscanf(argv[i], "%u", &feed->max_flow) != 1 || (int)feed->max_flow < 1) {
+            fprintf(stderr, "-max_flow takes litres a minute, at least 1\n");
+            fflush(stderr);
+            return 1;
+         }
+      }
+      if (strcmp(argv[i], "-angle") == 0) {
+         use_angle = true;
+      }
+      if (strcmp(argv[i], "-full_rate") == 0) {
+         adaptive_rate = false;
+      }
+      if (strcmp(argv[i], "-no_gate") == 0) {
+         motion_gate = false;
+      }
+      if (strcmp(argv[i], "-sync_interval") == 0) {
+         i++;
+         sync_interval = atoi(argv[i]);
+      }
+      if (strcmp(argv[i], "-metrics_port") == 0) {
+         i++;
+         metrics_port = atoi(argv[i]);
+      }
       if (strcmp(argv[i], "-start_value") == 0) {
          i++;
-         sscanf(argv[i], "%lf", &meter_start_value);
+         sscanf(argv[i], "%lf", &currentFeed()->start_value);
+      }
+      if (strcmp(argv[i], "-replay") == 0) {
+         i++;
+         feed = sourceFeed();
+         feed->device = argv[i];
+         feed->replay = true;
+      }
+      if (strcmp(argv[i], "-store") == 0) {
+         i++;
+         currentFeed()->store_name = argv[i];
+      }
+      if (strcmp(argv[i], "-history") == 0) {
+         i++;
+         currentFeed()->history_name = argv[i];
+      }
+      if (strcmp(argv[i], "-record") == 0) {
+         i++;
+         currentFeed()->record_file = argv[i];
+      }
+      if (strcmp(argv[i], "-fast") == 0) {
+         replay_realtime = false;
       }
    }
 
-   if (meter_start_value == 0.0) {
-      FILE *fp = fopen(WATER_METER_TOTAL_FILE, "r");
-      if (fp) {
-         fscanf(fp, "%lf", &meter_start_value);
-         fclose(fp);
+   // without any options watch the default camera
+   feed = currentFeed();
+   if (!feed->device) feed->device = "/dev/video0";
+
+   for (i = 0; i < n_feeds; i++) {
+      feed = &feeds[i];
+
+      // each named meter keeps its own running total and history, the store
+      // is named after the total it replaces
+      if (*feed->name) {
+         if (snprintf(feed->total_file, sizeof(feed->total_file), "%s-%s", WATER_METER_TOTAL_FILE,
+                      feed->name) >= (int)sizeof(feed->total_file) ||
+             snprintf(feed->store_file, sizeof(feed->store_file), "%s-%s%s", WATER_METER_TOTAL_FILE, feed->name,
+                      WATER_METER_STORE_SUFFIX) >= (int)sizeof(feed->store_file) ||
+             snprintf(feed->history_file, sizeof(feed->history_file), "%s-%s", WATER_METER_HISTORY_FILE,
+                      feed->name) >= (int)sizeof(feed->history_file)) {
+            fprintf(stderr, "Meter name %s is too long\n", feed->name);
+            fflush(stderr);
+            return 1;
+         }
+      } else {
+         snprintf(feed->total_file, sizeof(feed->total_file), "%s", WATER_METER_TOTAL_FILE);
+         snprintf(feed->store_file, sizeof(feed->store_file), "%s%s", WATER_METER_TOTAL_FILE, WATER_METER_STORE_SUFFIX);
+         snprintf(feed->history_file, sizeof(feed->history_file), "%s", WATER_METER_HISTORY_FILE);
+      }
+
+      // a replay would add its flow to the meter's history and overwrite its
+      // total, it only keeps them in files it is given
+      if (feed->history_name) {
+         feed->history = histOpen(feed->history_name, HIST_RECORDS, 1);
+      } else if (!feed->replay) {
+         feed->history = histOpen(feed->history_file, HIST_RECORDS, 1);
       }
+
+      // carry on from the last total written, a meter without a store yet
+      // takes over the old text file
+      if (feed->store_name) {
+         feed->store = storeOpen(feed->store_name, sync_interval);
+      } else if (!feed->replay) {
+         feed->store = storeOpen(feed->store_file, sync_interval);
+      }
+      if (feed->start_value == 0.0 && (!feed->store || storeLoad(feed->store, &feed->start_value) != 0) &&
+          !feed->replay) {
+         FILE *fp = fopen(feed->total_file, "r");
+         if (fp) {
+            fscanf(fp, "%lf", &feed->start_value);
+            fclose(fp);
+         }
+      }
+      metLabel(feed->labels, sizeof(feed->labels), "meter", feed->name);
+      metLabel(feed->labels, sizeof(feed->labels), "device", feed->device);
+      feed->published_last_minute   = -1.0;
+      feed->published_last_10minute = -1.0;
+      feed->published_last_drain    = -1.0;
+      feed->published_total         = -1.0;
    }
 
 
 #ifdef USE_MQTT
-   // initialise mosquitto connection
-   mosquitto_lib_init();
-   mosq = mosquitto_new(NULL, clean_session, NULL);
-   if (!mosq) {
+   // connect to the broker in the background, readings are spooled to disk
+   // until it is reachable
+   pub = pubOpen(host, port, keepalive, WATER_METER_SPOOL_FILE);
+   if (!pub) {
       fprintf(stderr, "Error: Out of memory.\n");
       fflush(stderr);
       return 1;
    }
-
-   if(mosquitto_connect(mosq, host, port, keepalive)){
-      fprintf(stderr, "Unable to connect.\n");
-      fflush(stderr);
-      return 1;
-   }
 #endif
 
    // initialise the image library
    init_imgproc();
 
-   // open the webcam
-   cam = camOpen(IMAGE_WIDTH, IMAGE_HEIGHT);
-   if (!cam) {
-      fprintf(stderr, "Unable to open camera\n");
-      fflush(stderr);
-      exit(1);
-   }
+   for (i = 0; i < n_feeds; i++) {
+      feed = &feeds[i];
 
-   // create a new viewer of the same resolution with a caption
-   if (display_image) {
-      view = viewOpen(IMAGE_WIDTH, IMAGE_HEIGHT, "WATER-METER");
-      if (!view) {
-         fprintf(stderr, "Unable to open view\n");
+      // lay out the detection regions
+      feed->meter = meterNew(feed->name, feed->org_x, feed->org_y, feed->org_r, feed->regions);
+      if (!feed->meter) {
+         fprintf(stderr, "Error: Out of memory.\n");
+         fflush(stderr);
+         exit(1);
+      }
+      feed->meter->start_value = feed->start_value;
+
+      // the gate watches what the analysis decodes
+      unsigned int n_rects = 1;
+      const Rect *rects = use_angle ? &feed->meter->dial_box : regionDecodeRects(feed->meter, &n_rects);
+      if (gateInit(&feed->gate, rects, n_rects) != 0) {
+         fprintf(stderr, "Error: Out of memory.\n");
          fflush(stderr);
          exit(1);
       }
-   }
 
-   // capture images from the webcam
-   while(1){
-      Image *img = camGrabImage(cam);
-      if (!img) {
-         fprintf(stderr, "Unable to grab image\n");
+      // open the webcam, or a recorded capture
+      if (feed->replay) {
+         feed->cam = camOpenReplay(feed->device, feed->width, feed->height, replay_realtime);
+         feed->replay_start = time(0);
+      } else {
+         feed->cam = camOpenDeviceFormat(feed->device, feed->width, feed->height,
+                                         feed->mjpeg ? V4L2_PIX_FMT_MJPEG : 0);
+         all_replays = false;
+      }
+      if (!feed->cam) {
+         fprintf(stderr, "Unable to open camera %s\n", feed->device);
          fflush(stderr);
          exit(1);
       }
 
-      // check if any region has a hit
-      new_region_number = regionHit(img);
+      // the dial has to be inside the picture
+      Rect *box = &feed->meter->dial_box;
+      if (feed->org_x < feed->org_r || feed->org_y < feed->org_r ||
+          box->x + box->w > camGetWidth(feed->cam) || box->y + box->h > camGetHeight(feed->cam)) {
+         fprintf(stderr, "%s: dial at %u,%u radius %u is outside the %ux%u image\n", feed->device,
+                 feed->org_x, feed->org_y, feed->org_r, camGetWidth(feed->cam), camGetHeight(feed->cam));
+         fflush(stderr);
+         exit(1);
+      }
+
+      // stream the raw frames to disk as they are captured
+      if (feed->record_file) {
+         feed->rec = recOpen(feed->record_file, feed->cam);
+         if (!feed->rec) {
+            fprintf(stderr, "Unable to open recording\n");
+            fflush(stderr);
+            exit(1);
+         }
+      }
+   }
 
-      // update accumulated values
-      updateValues(new_region_number);
+   // create a new viewer of the same resolution with a caption
+   if (display_image) {
+      view = viewOpen(camGetWidth(feeds[0].cam), camGetHeight(feeds[0].cam), "WATER-METER");
+      if (!view) {
+         fprintf(stderr, "Unable to open view\n");
+         fflush(stderr);
+         exit(1);
+      }
+   }
 
-      if (display_image) {
-         for (i = 0; i < NUM_REGIONS; i++) {
+   // live cameras drop frames the analysis has no time for, replays are
+   // analysed frame by frame however long it takes
+   frame_ring   = ringNew(FRAME_RING_SIZE, sizeof(FrameMsg), all_replays ? RING_BLOCK : RING_DROP);
+   display_ring = ringNew(DISPLAY_RING_SIZE, sizeof(DisplayMsg), RING_DROP);
+   publish_ring = ringNew(PUBLISH_RING_SIZE, sizeof(PublishMsg), RING_DROP);
+   if (!frame_ring || !display_ring || !publish_ring) {
+      fprintf(stderr, "Unable to create pipeline\n");
+      fflush(stderr);
+      exit(1);
+   }
 
-            unsigned char red = 0;
-            unsigned char green= 255;
-            unsigned char blue = 0;
+   // the stop and dump signals are only taken by the capture thread's event
+   // loop, the threads inherit the mask
+   sigemptyset(&stop_signals);
+   sigaddset(&stop_signals, SIGINT);
+   sigaddset(&stop_signals, SIGTERM);
+   sigaddset(&stop_signals, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+   // served from a thread of its own, a scrape never holds up the pipeline
+   if (metrics_port > 0) {
+      for (i = 0; i < n_feeds; i++) feedValues(&feeds[i]);
+      metrics = metOpen(metrics_port, writeMetrics);
+   }
 
-            if (i == new_region_number) {
-               red = 255;
-               green = 0;
-               blue = 0;
-            }
-            drawRegion(img, region[i], red, green, blue);
-         }
-         // display the image to view the changes
-         viewDisplayImage(view, img);
+   clock_gettime(CLOCK_MONOTONIC, &start_time);
+   pthread_create(&capture_thread, NULL, captureThread, NULL);
+   pthread_create(&analysis_thread, NULL, analysisThread, NULL);
+
+   runOutput();
+
+   pthread_join(capture_thread, NULL);
+   pthread_join(analysis_thread, NULL);
+
+   clock_gettime(CLOCK_MONOTONIC, &end_time);
+   double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+   unsigned long gated = 0;
+   for (i = 0; i < n_feeds; i++) gated += feeds[i].gate.gated;
+   fprintf(stdout, "%lu frames in %.2f s, %.1f frames/s, %lu skipped while idle, %lu gated as unchanged\n",
+           frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0, skipped, gated);
+   if (n_feeds > 1) {
+      for (i = 0; i < n_feeds; i++) {
+         fprintf(stdout, "  %s: %lu frames, %lu gated, %lu passed\n", feeds[i].device, feeds[i].frames,
+              feeds[i].gate.gated, feeds[i].gate.passed);
       }
+   }
+   fflush(stdout);
 
-      // destroy image
-      imgDestroy(img);
+   reportPipeline();
+   latDump(stdout);
+
+   for (i = 0; i < n_feeds; i++) {
+      if (feeds[i].rec) recClose(feeds[i].rec);
    }
 
+   ringFree(frame_ring);
+   ringFree(display_ring);
+   ringFree(publish_ring);
+
    // cleanup and exit
    cleanup(0, NULL, NULL);
    return 0;
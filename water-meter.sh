@@ -1,11 +1,13 @@
 #!/bin/bash
 PIDFILE=$1
 mkdir -p /home/pi/logs
+# the water meter resets and reopens a lost camera itself, this only brings it
+# back should it exit
 while [ 1=1 ]
 do
 #exec /home/pi/water-meter/water-meter >>/home/pi/logs/water-meter.log 2>&1 </dev/null
 /home/pi/water-meter/water-meter >>/home/pi/logs/water-meter.log 2>&1 </dev/null
-/home/pi/water-meter/usbreset /dev/bus/usb/001/004
+sleep 5
 #CHILD=$!
 #echo $CHILD > $PIDFILE
 done